@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include "Matrix.cpp"
+
+
+// COUNT matrices of the same fixed size R x C in one allocation, stored as a
+// structure of arrays: element (i, j) of every matrix is contiguous, at
+// lane(i, j)[0 .. COUNT). Operations loop over the matrices innermost, so the
+// compiler vectorizes across the batch, and the batch is walked in chunks of
+// CHUNK matrices so the lanes a chunk touches stay in cache. Lanes are padded
+// to whole chunks, so every inner loop has the same constant trip count.
+// Element by element operations skip the padding, so a function like 1 / x
+// never sees the elements past COUNT.
+template <typename T, unsigned R, unsigned C>
+class BatchMatrix{
+private:
+    static const size_t CHUNK = 128;
+
+    size_t COUNT, STRIDE;       // STRIDE is COUNT rounded up to whole chunks
+    std::vector<T> DATA;
+
+    template <typename U, unsigned R2, unsigned C2> friend class BatchMatrix;
+
+    template <typename Func>
+    void for_chunks(Func func) const {
+        for (size_t b0 = 0 ; b0 < STRIDE ; b0 += CHUNK){
+            func(b0);
+        }
+    }
+
+    // Calls func(k) for the offset k of every element of every matrix,
+    // lane by lane, leaving out the padding.
+    template <typename Func>
+    void for_elements(Func func) const {
+        for (size_t start = 0 ; start < DATA.size() ; start += STRIDE){
+            for (size_t k = start ; k < start + COUNT ; k++){
+                func(k);
+            }
+        }
+    }
+
+    template <typename Op>
+    BatchMatrix combine(const BatchMatrix& m, Op op) const {
+        if (COUNT != m.COUNT){
+            throw std::runtime_error("Error: Batch size mismatch!");
+        }
+        BatchMatrix B(COUNT);
+        const T* a = DATA.data();
+        const T* b = m.DATA.data();
+        T* out = B.DATA.data();
+        for_elements([&](size_t k){ out[k] = op(a[k], b[k]); });
+        return B;
+    }
+
+public:
+    explicit BatchMatrix(size_t count = 0, T value = T())
+        : COUNT(count), STRIDE((count + CHUNK - 1) / CHUNK * CHUNK), DATA((size_t)R * C * STRIDE, value) {
+        static_assert(AllowType<T>::allowed, "Error: This type is not supported in BatchMatrix!");
+        static_assert(R > 0 && C > 0, "Error: BatchMatrix needs a size!");
+    }
+
+    size_t size() const { return COUNT; }
+    static constexpr unsigned get_rows() { return R; }
+    static constexpr unsigned get_cols() { return C; }
+
+    T* lane(unsigned i, unsigned j) { return DATA.data() + ((size_t)i * C + j) * STRIDE; }
+    const T* lane(unsigned i, unsigned j) const { return DATA.data() + ((size_t)i * C + j) * STRIDE; }
+
+    T& operator()(size_t index, unsigned i, unsigned j){
+        return lane(i, j)[index];
+    }
+
+    const T& operator()(size_t index, unsigned i, unsigned j) const {
+        return lane(i, j)[index];
+    }
+
+    // Conversions of single matrices, for setup and inspection.
+    Matrix<T> get(size_t index) const {
+        if (index >= COUNT){
+            throw std::runtime_error("Error: Invalid index!");
+        }
+        Matrix<T> M(R, C);
+        for (unsigned i = 0 ; i < R ; i++){
+            for (unsigned j = 0 ; j < C ; j++){
+                M(i, j) = lane(i, j)[index];
+            }
+        }
+        return M;
+    }
+
+    void set(size_t index, const Matrix<T>& m){
+        if (index >= COUNT){
+            throw std::runtime_error("Error: Invalid index!");
+        }
+        if (m.get_rows() != R || m.get_cols() != C){
+            throw std::runtime_error("Error: Size mismatch!");
+        }
+        for (unsigned i = 0 ; i < R ; i++){
+            for (unsigned j = 0 ; j < C ; j++){
+                lane(i, j)[index] = m(i, j);
+            }
+        }
+    }
+
+    // Matrix product of every pair, (*this)[b] * m[b]. The overloads taking
+    // out write into an existing batch of the right size, so repeated
+    // products allocate nothing; out must not be one of the operands.
+    template <unsigned K>
+    void multiply(const BatchMatrix<T, C, K>& m, BatchMatrix<T, R, K>& out) const {
+        if (COUNT != m.COUNT || COUNT != out.COUNT){
+            throw std::runtime_error("Error: Batch size mismatch!");
+        }
+        for_chunks([&](size_t b0){
+            for (unsigned i = 0 ; i < R ; i++){
+                for (unsigned j = 0 ; j < K ; j++){
+                    T sum[CHUNK] = {};
+                    for (unsigned k = 0 ; k < C ; k++){
+                        const T* x = lane(i, k) + b0;
+                        const T* y = m.lane(k, j) + b0;
+                        for (size_t b = 0 ; b < CHUNK ; b++){
+                            sum[b] += x[b] * y[b];
+                        }
+                    }
+                    std::copy(sum, sum + CHUNK, out.lane(i, j) + b0);
+                }
+            }
+        });
+    }
+
+    template <unsigned K>
+    BatchMatrix<T, R, K> multiply(const BatchMatrix<T, C, K>& m) const {
+        BatchMatrix<T, R, K> B(COUNT);
+        multiply(m, B);
+        return B;
+    }
+
+    // Every matrix times the same C x C matrix m, whose elements are
+    // scalars to the inner loop.
+    void multiply(const Matrix<T>& m, BatchMatrix& out) const {
+        if (m.get_rows() != C || m.get_cols() != C){
+            throw std::runtime_error("Error: Can't multiply!");
+        }
+        if (COUNT != out.COUNT){
+            throw std::runtime_error("Error: Batch size mismatch!");
+        }
+        for_chunks([&](size_t b0){
+            for (unsigned i = 0 ; i < R ; i++){
+                for (unsigned j = 0 ; j < C ; j++){
+                    T sum[CHUNK] = {};
+                    for (unsigned k = 0 ; k < C ; k++){
+                        const T* x = lane(i, k) + b0;
+                        T y = m(k, j);
+                        for (size_t b = 0 ; b < CHUNK ; b++){
+                            sum[b] += x[b] * y;
+                        }
+                    }
+                    std::copy(sum, sum + CHUNK, out.lane(i, j) + b0);
+                }
+            }
+        });
+    }
+
+    BatchMatrix multiply(const Matrix<T>& m) const {
+        BatchMatrix B(COUNT);
+        multiply(m, B);
+        return B;
+    }
+
+    BatchMatrix<T, C, R> transpose() const {
+        BatchMatrix<T, C, R> B(COUNT);
+        for (unsigned i = 0 ; i < R ; i++){
+            for (unsigned j = 0 ; j < C ; j++){
+                std::copy(lane(i, j), lane(i, j) + STRIDE, B.lane(j, i));
+            }
+        }
+        return B;
+    }
+
+    BatchMatrix operator+(const BatchMatrix& m) const { return combine(m, [](T a, T b){ return a + b; }); }
+    BatchMatrix operator-(const BatchMatrix& m) const { return combine(m, [](T a, T b){ return a - b; }); }
+
+    template <unsigned K>
+    BatchMatrix<T, R, K> operator*(const BatchMatrix<T, C, K>& m) const { return multiply(m); }
+
+    BatchMatrix operator*(const Matrix<T>& m) const { return multiply(m); }
+
+    BatchMatrix& operator+=(const BatchMatrix& m){
+        if (COUNT != m.COUNT){
+            throw std::runtime_error("Error: Batch size mismatch!");
+        }
+        for_elements([&](size_t k){ DATA[k] += m.DATA[k]; });
+        return *this;
+    }
+
+    BatchMatrix& operator-=(const BatchMatrix& m){
+        if (COUNT != m.COUNT){
+            throw std::runtime_error("Error: Batch size mismatch!");
+        }
+        for_elements([&](size_t k){ DATA[k] -= m.DATA[k]; });
+        return *this;
+    }
+
+    template <typename Func>
+    BatchMatrix apply(Func func) const {
+        BatchMatrix B(COUNT);
+        for_elements([&](size_t k){ B.DATA[k] = func(DATA[k]); });
+        return B;
+    }
+
+    template <typename Func>
+    void apply(Func func){
+        for_elements([&](size_t k){ DATA[k] = func(DATA[k]); });
+    }
+};
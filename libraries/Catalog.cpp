@@ -0,0 +1,239 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "Matrix.cpp"
+#include "Engine.cpp"
+#include "Shapes.cpp"
+
+
+// Limits of the formats pieces are stored in: replays keep a 4-bit shape
+// index and a 2-bit rotation, feature masks one bit per piece, and hands
+// are shown side by side in 5 columns each.
+const unsigned CATALOG_MAX_SHAPES = 16;
+const unsigned CATALOG_MAX_PIECES = 64;
+const unsigned CATALOG_MAX_EXTENT = 5;
+
+// Every piece the game can deal, built once: the Matrix<bool> for display and
+// the reference rules, its bitboard mask, and its probability. A piece is one
+// distinct rotation of a shape, referred to by id, so a hand is three bytes.
+// Ids run shape by shape, each shape's rotations in the order 0, 90, 180 and
+// 270 degrees, skipping rotations that look the same.
+//
+// Drawing uses an alias table (Vose), so any weighting costs one random
+// number and one comparison per piece.
+class piece_catalog{
+private:
+    std::vector<uint32_t> threshold;
+    std::vector<uint8_t> alias;
+
+public:
+    std::vector<Matrix<bool>> shapes;       // by id
+    std::vector<piece_mask> masks;          // by id
+    std::vector<double> probabilities;      // by id, sums to 1
+    std::vector<uint8_t> shape_of;          // by id
+    std::vector<uint8_t> rotation_of;       // by id, index among the shape's distinct rotations
+    unsigned shape_count = 0;
+    uint64_t fingerprint = 0;               // identifies the pieces and the draw table, set by finish()
+
+    // Adds one piece of the given shape, with an unnormalized probability.
+    void add_piece(const piece_mask& p, unsigned shape, unsigned rotation, double weight){
+        if (masks.size() == CATALOG_MAX_PIECES){
+            throw std::runtime_error("Error: A shape set can have at most " + std::to_string(CATALOG_MAX_PIECES) + " pieces");
+        }
+        shapes.push_back(piece_to_matrix(p));
+        masks.push_back(p);
+        probabilities.push_back(weight);
+        shape_of.push_back(shape);
+        rotation_of.push_back(rotation);
+        if (shape >= shape_count) shape_count = shape + 1;
+    }
+
+    // Adds a shape in all its distinct rotations, which share its weight.
+    void add_shape(const Matrix<bool>& shape, double weight){
+        if (shape_count == CATALOG_MAX_SHAPES){
+            throw std::runtime_error("Error: A shape set can have at most " + std::to_string(CATALOG_MAX_SHAPES) + " shapes");
+        }
+
+        piece_mask rotations[4];
+        unsigned count = distinct_rotations(piece_from_matrix(shape), rotations);
+        if (masks.size() + count > CATALOG_MAX_PIECES){
+            throw std::runtime_error("Error: A shape set can have at most " + std::to_string(CATALOG_MAX_PIECES) + " pieces");
+        }
+        uint64_t siblings = ((1ull << count) - 1) << masks.size();
+        unsigned index = shape_count;
+        for (unsigned r = 0 ; r < count ; r++){
+            rotations[r].rotations = siblings;
+            add_piece(rotations[r], index, r, weight / count);
+        }
+    }
+
+    // Normalizes the weights and builds the alias table. Call once all
+    // shapes are added.
+    void finish(){
+        size_t n = probabilities.size();
+
+        double total = 0;
+        for (double w : probabilities) total += w;
+        for (double& w : probabilities) w /= total;
+
+        std::vector<double> scaled(n);
+        std::vector<unsigned> small, large;
+        for (size_t i = 0 ; i < n ; i++){
+            scaled[i] = probabilities[i] * n;
+            if (scaled[i] < 1) small.push_back(i);
+            else large.push_back(i);
+        }
+
+        threshold.assign(n, UINT32_MAX);
+        alias.resize(n);
+        for (size_t i = 0 ; i < n ; i++) alias[i] = i;
+
+        while (!small.empty() && !large.empty()){
+            unsigned s = small.back(), l = large.back();
+            small.pop_back();
+            threshold[s] = (uint32_t)(scaled[s] * 4294967296.0);
+            alias[s] = l;
+            scaled[l] -= 1 - scaled[s];
+            if (scaled[l] < 1){
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+
+        // FNV-1a over everything that decides which pieces a seed deals and
+        // what they look like, so files recorded with one shape set can tell
+        // they are read with another of the same size.
+        fingerprint = 0xcbf29ce484222325ull;
+        auto mix = [&](uint64_t v){
+            for (unsigned b = 0 ; b < 8 ; b++, v >>= 8){
+                fingerprint = (fingerprint ^ (v & 0xff)) * 0x100000001b3ull;
+            }
+        };
+        for (size_t i = 0 ; i < n ; i++){
+            mix(masks[i].mask);
+            mix(masks[i].rows | (masks[i].cols << 8) | (shape_of[i] << 16) | ((uint64_t)rotation_of[i] << 24));
+            mix(threshold[i] | ((uint64_t)alias[i] << 32));
+        }
+    }
+
+    size_t size() const { return masks.size(); }
+
+    // One piece id. The high half of the random word picks a column, the low
+    // half decides between it and its alias.
+    uint8_t draw(game_rng& rng) const {
+        uint64_t r = rng.next();
+        uint32_t column = (uint32_t)(((r >> 32) * masks.size()) >> 32);
+        return (uint32_t)r < threshold[column] ? column : alias[column];
+    }
+};
+
+
+// The built-in shapes, all equally likely, from the tables the compiler
+// built in Shapes.cpp.
+inline piece_catalog built_in_catalog(){
+    piece_catalog catalog;
+    for (const built_in_piece& b : BUILT_IN_PIECES){
+        catalog.add_piece(b.piece, b.shape, b.rotation, 1.0 / __builtin_popcountll(b.piece.rotations));
+    }
+    catalog.finish();
+    return catalog;
+}
+
+
+// Reads a shape set. Shapes are drawn with '*' for a filled cell and '.'
+// (or any other character) for an empty one, and separated by blank lines.
+// A "weight W" line before a shape makes it W times as likely as a shape of
+// weight 1, the default. Lines starting with '#' are comments. Empty border
+// rows and columns are trimmed, so shapes can be drawn on a fixed grid.
+//
+//   # the 2x2 square, twice as often
+//   weight 2
+//   **
+//   **
+inline piece_catalog load_shape_file(const std::string& path){
+    std::ifstream file(path);
+    if (!file.is_open()){
+        throw std::runtime_error("Error: Can't open shape file " + path);
+    }
+
+    piece_catalog catalog;
+    std::vector<std::string> rows;
+    double weight = 1;
+    size_t line_number = 0;
+    size_t shape_line = 0;
+
+    auto fail = [&](size_t line, const std::string& message){
+        throw std::runtime_error("Error: " + path + ":" + std::to_string(line) + ": " + message);
+    };
+
+    auto finish_shape = [&](){
+        if (rows.empty()) return;
+
+        size_t top = rows.size(), bottom = 0, left = SIZE_MAX, right = 0;
+        for (size_t i = 0 ; i < rows.size() ; i++){
+            size_t first = rows[i].find('*'), last = rows[i].rfind('*');
+            if (first == std::string::npos) continue;
+            if (top == rows.size()) top = i;
+            bottom = i;
+            if (first < left) left = first;
+            if (last > right) right = last;
+        }
+        if (top == rows.size()) fail(shape_line, "shape has no filled cells");
+        if (bottom - top >= CATALOG_MAX_EXTENT || right - left >= CATALOG_MAX_EXTENT){
+            fail(shape_line, "shape is larger than " + std::to_string(CATALOG_MAX_EXTENT) + "x" + std::to_string(CATALOG_MAX_EXTENT));
+        }
+
+        Matrix<bool> shape(bottom - top + 1, right - left + 1, false);
+        for (size_t i = top ; i <= bottom ; i++){
+            for (size_t j = left ; j <= right && j < rows[i].size() ; j++){
+                shape(i - top, j - left) = rows[i][j] == '*';
+            }
+        }
+
+        try {
+            catalog.add_shape(shape, weight);
+        } catch (const std::runtime_error& e) {
+            throw std::runtime_error(std::string(e.what()) + " (" + path + ":" + std::to_string(shape_line) + ")");
+        }
+        rows.clear();
+        weight = 1;
+    };
+
+    std::string line;
+    while (std::getline(file, line)){
+        line_number++;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+
+        if (line.find_first_not_of(" \t") == std::string::npos){
+            finish_shape();
+        }
+        else if (line[0] == '#'){
+            continue;
+        }
+        else if (line.compare(0, 6, "weight") == 0){
+            if (!rows.empty()) fail(line_number, "weight must come before the shape's rows");
+            size_t used = 0;
+            try {
+                weight = std::stod(line.substr(6), &used);
+            } catch (const std::exception&) {
+                used = 0;
+            }
+            if (used == 0 || !(weight > 0)) fail(line_number, "expected a positive number after weight");
+        }
+        else{
+            if (rows.empty()) shape_line = line_number;
+            rows.push_back(line);
+        }
+    }
+    finish_shape();
+
+    if (catalog.shape_count == 0){
+        throw std::runtime_error("Error: No shapes in " + path);
+    }
+    catalog.finish();
+    return catalog;
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "Engine.cpp"
+#include "Features.cpp"
+#include "ThreadPool.cpp"
+
+
+struct danger_report{
+    double no_move = 0;         // no piece of the next hand fits at all
+    double dies_in_hand = 0;    // the next hand can't be placed completely, in any order
+};
+
+// Exact probabilities over every hand of three pieces drawn independently from
+// the catalog. Hands are enumerated as multisets (a <= b <= c) weighted by
+// their number of orderings, one first piece per pool task. Each worker
+// memoizes "can these two pieces both still be placed on this board", which
+// most hands sharing a first placement ask again.
+class danger_analyzer{
+private:
+    struct memo_entry{
+        uint64_t board = 0;
+        uint16_t pair = 0xFFFF;
+        bool result = false;
+    };
+
+    struct alignas(64) worker_scratch{
+        std::vector<memo_entry> memo;
+    };
+
+    static const unsigned MEMO_BITS = 16;
+
+    const std::vector<piece_mask>& catalog;
+    std::vector<double> weights;
+    thread_pool& pool;
+    std::vector<worker_scratch> scratches;
+    std::vector<double> partial;
+
+    static uint64_t after(uint64_t board, const piece_mask& p, unsigned anchor){
+        board |= p.mask << anchor;
+        clear_full_lines(board);
+        return board;
+    }
+
+    bool place_two(uint64_t board, unsigned b, unsigned c, worker_scratch& s){
+        if (b > c) std::swap(b, c);
+        uint16_t pair = b * 64 + c;
+        uint64_t h = (board ^ (pair * 0x9e3779b97f4a7c15ull)) * 0xbf58476d1ce4e5b9ull;
+        memo_entry& e = s.memo[h >> (64 - MEMO_BITS)];
+        if (e.board == board && e.pair == pair) return e.result;
+
+        bool result = false;
+        for (unsigned order = 0 ; order < 2 && !result ; order++){
+            const piece_mask& first = catalog[order ? c : b];
+            const piece_mask& second = catalog[order ? b : c];
+            for (uint64_t anchors = piece_placements(board, first) ; anchors && !result ; anchors &= anchors - 1){
+                result = piece_placements(after(board, first, __builtin_ctzll(anchors)), second) != 0;
+            }
+            if (b == c) break;
+        }
+
+        e.board = board;
+        e.pair = pair;
+        e.result = result;
+        return result;
+    }
+
+    bool place_three(uint64_t board, unsigned a, unsigned b, unsigned c, worker_scratch& s){
+        unsigned hand[3] = {a, b, c};
+        for (unsigned i = 0 ; i < 3 ; i++){
+            if (i > 0 && hand[i] == hand[i - 1]) continue;      // hand is sorted
+            unsigned x = hand[(i + 1) % 3], y = hand[(i + 2) % 3];
+            const piece_mask& first = catalog[hand[i]];
+            for (uint64_t anchors = piece_placements(board, first) ; anchors ; anchors &= anchors - 1){
+                if (place_two(after(board, first, __builtin_ctzll(anchors)), x, y, s)) return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    // Every catalog piece is equally likely unless weights are set.
+    danger_analyzer(const std::vector<piece_mask>& pieces, thread_pool& workers)
+        : catalog(pieces), weights(pieces.size(), 1.0 / pieces.size()), pool(workers), scratches(workers.size()) {
+        for (worker_scratch& s : scratches){
+            s.memo.resize(1u << MEMO_BITS);
+        }
+    }
+
+    void set_weights(const std::vector<double>& w){
+        double total = 0;
+        for (double x : w) total += x;
+        for (size_t i = 0 ; i < weights.size() ; i++){
+            weights[i] = w[i] / total;
+        }
+    }
+
+    danger_report analyze(uint64_t board){
+        danger_report report;
+        size_t n = catalog.size();
+        uint64_t fits = piece_fit_bits(board, catalog);
+
+        double stuck = 0;
+        for (size_t i = 0 ; i < n ; i++){
+            if (!((fits >> i) & 1)) stuck += weights[i];
+        }
+        report.no_move = stuck * stuck * stuck;
+
+        partial.assign(n, 0);
+        pool.parallel_for(n, [&](unsigned worker, size_t a){
+            worker_scratch& s = scratches[worker];
+            double p = 0;
+            for (size_t b = a ; b < n ; b++){
+                for (size_t c = b ; c < n ; c++){
+                    if (place_three(board, a, b, c, s)) continue;
+                    double orderings = (a == b && b == c) ? 1 : (a == b || b == c) ? 3 : 6;
+                    p += orderings * weights[a] * weights[b] * weights[c];
+                }
+            }
+            partial[a] = p;
+        });
+
+        for (size_t a = 0 ; a < n ; a++){
+            report.dies_in_hand += partial[a];
+        }
+        return report;
+    }
+};
+
+
+// The linear evaluator with the chance of dying in the next hand as an
+// extra, much more expensive, term. A zero risk_weight leaves the term out;
+// START_RISK_WEIGHT is where tuning starts when it is switched on.
+struct risk_evaluator{
+    static constexpr float START_RISK_WEIGHT = -100.0f;
+
+    linear_evaluator linear;
+    float risk_weight = 0;
+
+    float evaluate(uint64_t board, danger_analyzer& danger, const std::vector<piece_mask>& pieces) const {
+        return linear.evaluate(board, pieces) + risk_weight * (float)danger.analyze(board).dies_in_hand;
+    }
+};
@@ -0,0 +1,273 @@
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <vector>
+#include "Matrix.cpp"
+
+
+// Seedable generator for everything the game draws. The whole state is four
+// words, so a game can be reproduced (or saved) from its seed alone.
+struct game_rng{
+    uint64_t state[4];
+
+    static uint64_t splitmix64(uint64_t& x){
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    static uint64_t make_seed(){
+        return std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+
+    explicit game_rng(uint64_t seed = 0){
+        reseed(seed);
+    }
+
+    void reseed(uint64_t seed){
+        for (unsigned i = 0 ; i < 4 ; i++){
+            state[i] = splitmix64(seed);
+        }
+    }
+
+    // xoshiro256**
+    uint64_t next(){
+        uint64_t result = rotl(state[1] * 5, 7) * 9;
+        uint64_t t = state[1] << 17;
+
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+
+        return result;
+    }
+
+    // Uniform in [0, n) without modulo bias, identical on every platform
+    // (unlike std::uniform_int_distribution).
+    uint32_t below(uint32_t n){
+        uint64_t m = (uint64_t)(uint32_t)(next() >> 32) * n;
+        uint32_t low = (uint32_t)m;
+        if (low < n){
+            uint32_t threshold = (uint32_t)(-n) % n;
+            while (low < threshold){
+                m = (uint64_t)(uint32_t)(next() >> 32) * n;
+                low = (uint32_t)m;
+            }
+        }
+        return (uint32_t)(m >> 32);
+    }
+
+private:
+    static uint64_t rotl(uint64_t x, int k){
+        return (x << k) | (x >> (64 - k));
+    }
+};
+
+
+// The game board as a 64-bit mask, bit (row * 8 + col) set for a filled cell.
+// Everything here follows the rules of place_piece / clear_lines and the
+// scoring in run_game, only without allocating.
+const unsigned BOARD_SIZE = 8;
+const uint64_t BOARD_FIRST_COL = 0x0101010101010101ull;
+const uint64_t BOARD_FIRST_ROW = 0xFFull;
+
+struct piece_mask{
+    uint64_t mask = 0;      // cells with the piece anchored at (0, 0)
+    uint64_t anchors = 0;   // anchors that keep the piece inside the board
+    uint64_t rotations = 0; // catalog ids of every rotation of the same shape
+    uint8_t rows = 0;
+    uint8_t cols = 0;
+    uint8_t cells = 0;
+};
+
+// Fills in cells and anchors for a mask of the given size. constexpr, so
+// the built-in pieces are computed by the compiler.
+constexpr piece_mask make_piece(uint64_t mask, unsigned rows, unsigned cols){
+    piece_mask p;
+    p.mask = mask;
+    p.rows = rows;
+    p.cols = cols;
+    p.cells = __builtin_popcountll(mask);
+    for (unsigned i = 0 ; i + rows <= BOARD_SIZE ; i++){
+        for (unsigned j = 0 ; j + cols <= BOARD_SIZE ; j++){
+            p.anchors |= 1ull << (i * BOARD_SIZE + j);
+        }
+    }
+    return p;
+}
+
+// The piece turned 90 degrees clockwise.
+constexpr piece_mask rotate_piece(const piece_mask& p){
+    uint64_t mask = 0;
+    for (unsigned i = 0 ; i < p.cols ; i++){
+        for (unsigned j = 0 ; j < p.rows ; j++){
+            if ((p.mask >> ((p.rows - j - 1) * BOARD_SIZE + i)) & 1) mask |= 1ull << (i * BOARD_SIZE + j);
+        }
+    }
+    return make_piece(mask, p.cols, p.rows);
+}
+
+inline piece_mask piece_from_matrix(const Matrix<bool>& shape){
+    uint64_t mask = 0;
+    for (unsigned i = 0 ; i < shape.get_rows() ; i++){
+        for (unsigned j = 0 ; j < shape.get_cols() ; j++){
+            if (shape(i, j)) mask |= 1ull << (i * BOARD_SIZE + j);
+        }
+    }
+    return make_piece(mask, shape.get_rows(), shape.get_cols());
+}
+
+inline Matrix<bool> piece_to_matrix(const piece_mask& p){
+    Matrix<bool> shape(p.rows, p.cols, false);
+    for (unsigned i = 0 ; i < p.rows ; i++){
+        for (unsigned j = 0 ; j < p.cols ; j++){
+            shape(i, j) = (p.mask >> (i * BOARD_SIZE + j)) & 1;
+        }
+    }
+    return shape;
+}
+
+inline uint64_t board_from_matrix(const Matrix<bool>& grid){
+    uint64_t board = 0;
+    for (unsigned i = 0 ; i < BOARD_SIZE ; i++){
+        for (unsigned j = 0 ; j < BOARD_SIZE ; j++){
+            if (grid(i, j)) board |= 1ull << (i * BOARD_SIZE + j);
+        }
+    }
+    return board;
+}
+
+inline void board_to_matrix(uint64_t board, Matrix<bool>& grid){
+    for (unsigned i = 0 ; i < BOARD_SIZE ; i++){
+        for (unsigned j = 0 ; j < BOARD_SIZE ; j++){
+            grid(i, j) = (board >> (i * BOARD_SIZE + j)) & 1;
+        }
+    }
+}
+
+inline bool piece_fits(uint64_t board, const piece_mask& p, unsigned row, unsigned col){
+    if (row + p.rows > BOARD_SIZE || col + p.cols > BOARD_SIZE) return false;
+    return (board & (p.mask << (row * BOARD_SIZE + col))) == 0;
+}
+
+// Every anchor where the piece can be placed, one bit per anchor. A cell at
+// offset b of the piece needs the board cell anchor + b empty, so the free
+// anchors are the empty cells shifted back by each offset, ANDed together.
+inline uint64_t piece_placements(uint64_t board, const piece_mask& p){
+    uint64_t empty = ~board;
+    uint64_t anchors = p.anchors;
+    for (uint64_t cells = p.mask ; cells ; cells &= cells - 1){
+        anchors &= empty >> __builtin_ctzll(cells);
+    }
+    return anchors;
+}
+
+inline bool piece_fits_anywhere(uint64_t board, const piece_mask& p){
+    return piece_placements(board, p) != 0;
+}
+
+// Mirrors the board about its main diagonal, so (row, col) becomes (col, row).
+inline uint64_t board_transpose(uint64_t board){
+    uint64_t t;
+    t = 0x0f0f0f0f00000000ull & (board ^ (board << 28));
+    board ^= t ^ (t >> 28);
+    t = 0x3333000033330000ull & (board ^ (board << 14));
+    board ^= t ^ (t >> 14);
+    t = 0x5500550055005500ull & (board ^ (board << 7));
+    board ^= t ^ (t >> 7);
+    return board;
+}
+
+// Bit (row * 8) set for every full row.
+inline uint64_t full_rows(uint64_t board){
+    board &= board >> 1;
+    board &= board >> 2;
+    board &= board >> 4;
+    return board & BOARD_FIRST_COL;
+}
+
+// Bit col set for every full column.
+inline uint64_t full_cols(uint64_t board){
+    board &= board >> 8;
+    board &= board >> 16;
+    board &= board >> 32;
+    return board & BOARD_FIRST_ROW;
+}
+
+struct cleared_lines{
+    unsigned rows = 0;
+    unsigned cols = 0;
+};
+
+inline cleared_lines clear_full_lines(uint64_t& board){
+    uint64_t rows = full_rows(board);
+    uint64_t cols = full_cols(board);
+    board &= ~(rows * BOARD_FIRST_ROW | cols * BOARD_FIRST_COL);
+
+    cleared_lines cleared;
+    cleared.rows = __builtin_popcountll(rows);
+    cleared.cols = __builtin_popcountll(cols);
+    return cleared;
+}
+
+// Board, score and combo of a game in progress.
+struct engine_state{
+    uint64_t board = 0;
+    uint32_t score = 0;
+    uint32_t combo = 0;
+
+    // Places the piece and scores it exactly like run_game. Returns false
+    // (leaving the state untouched) if it does not fit.
+    bool play(const piece_mask& p, unsigned row, unsigned col, cleared_lines* cleared = nullptr){
+        if (!piece_fits(board, p, row, col)) return false;
+
+        board |= p.mask << (row * BOARD_SIZE + col);
+        score += p.cells;
+
+        cleared_lines lines = clear_full_lines(board);
+        uint32_t points = (BOARD_SIZE * lines.rows + BOARD_SIZE * lines.cols) * (lines.rows + lines.cols);
+
+        if (points) combo++;
+        else combo = 0;
+
+        score += combo * points;
+        if (cleared) *cleared = lines;
+        return true;
+    }
+};
+
+// The pieces still to be placed, as ids into a piece catalog (see
+// Catalog.cpp), which also deals them.
+const unsigned HAND_SIZE = 3;
+
+struct game_hand{
+    uint8_t pieces[HAND_SIZE] = {};
+    uint8_t count = 0;
+
+    template <typename Catalog>
+    void draw(game_rng& rng, const Catalog& catalog){
+        for (unsigned i = 0 ; i < HAND_SIZE ; i++){
+            pieces[i] = catalog.draw(rng);
+        }
+        count = HAND_SIZE;
+    }
+
+    void remove(unsigned slot){
+        for (unsigned i = slot ; i + 1 < count ; i++){
+            pieces[i] = pieces[i + 1];
+        }
+        count--;
+    }
+
+    bool playable(uint64_t board, const std::vector<piece_mask>& catalog) const {
+        for (unsigned i = 0 ; i < count ; i++){
+            if (piece_placements(board, catalog[pieces[i]])) return true;
+        }
+        return false;
+    }
+};
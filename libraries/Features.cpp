@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "Engine.cpp"
+
+
+// Board features for automated players. Everything is computed on the 64-bit
+// board with shifts, masks and popcounts, without looping over cells.
+enum board_feature{
+    FEATURE_FILLED,             // filled cells
+    FEATURE_HOLES,              // empty cells whose four neighbours are filled or the edge
+    FEATURE_FREE_SQUARES,       // anchors of a fully empty 3x3 square (overlapping)
+    FEATURE_NEAR_ROWS,          // rows with 6 or 7 cells filled
+    FEATURE_NEAR_COLS,          // columns with 6 or 7 cells filled
+    FEATURE_TRANSITIONS,        // filled/empty changes between neighbouring cells
+    FEATURE_FITTING_PIECES,     // catalog pieces (shape and rotation) that still fit
+    FEATURE_FITTING_SHAPES,     // shapes that fit in at least one rotation
+    FEATURE_COUNT
+};
+
+struct board_features{
+    int32_t values[FEATURE_COUNT] = {};
+
+    int32_t operator[](unsigned i) const { return values[i]; }
+};
+
+const uint64_t BOARD_LAST_COL = BOARD_FIRST_COL << 7;
+const uint64_t BOARD_LAST_ROW = BOARD_FIRST_ROW << 56;
+
+// Bit i set when catalog piece i fits somewhere on the board (at most 64 pieces).
+inline uint64_t piece_fit_bits(uint64_t board, const std::vector<piece_mask>& pieces){
+    uint64_t bits = 0;
+    for (size_t i = 0 ; i < pieces.size() && i < 64 ; i++){
+        if (piece_placements(board, pieces[i])) bits |= 1ull << i;
+    }
+    return bits;
+}
+
+// Number of bytes (rows) holding 6 or 7 set bits.
+inline unsigned count_near_full_bytes(uint64_t x){
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return __builtin_popcountll((x >> 1) & (x >> 2) & ~(x >> 3) & BOARD_FIRST_COL);
+}
+
+// pieces is piece_catalog::masks, indexed by piece id.
+inline board_features extract_features(uint64_t board, const std::vector<piece_mask>& pieces){
+    board_features f;
+    uint64_t empty = ~board;
+
+    f.values[FEATURE_FILLED] = __builtin_popcountll(board);
+
+    uint64_t up = (board << 8) | BOARD_FIRST_ROW;
+    uint64_t down = (board >> 8) | BOARD_LAST_ROW;
+    uint64_t left = ((board << 1) & ~BOARD_FIRST_COL) | BOARD_FIRST_COL;
+    uint64_t right = ((board >> 1) & ~BOARD_LAST_COL) | BOARD_LAST_COL;
+    f.values[FEATURE_HOLES] = __builtin_popcountll(empty & up & down & left & right);
+
+    uint64_t across = empty & (empty >> 1) & (empty >> 2) & ~(BOARD_LAST_COL | (BOARD_LAST_COL >> 1));
+    uint64_t square = across & (across >> 8) & (across >> 16) & ~(BOARD_LAST_ROW | (BOARD_LAST_ROW >> 8));
+    f.values[FEATURE_FREE_SQUARES] = __builtin_popcountll(square);
+
+    f.values[FEATURE_NEAR_ROWS] = count_near_full_bytes(board);
+    f.values[FEATURE_NEAR_COLS] = count_near_full_bytes(board_transpose(board));
+
+    uint64_t horizontal = (board ^ (board >> 1)) & ~BOARD_LAST_COL;
+    uint64_t vertical = (board ^ (board >> 8)) & ~BOARD_LAST_ROW;
+    f.values[FEATURE_TRANSITIONS] = __builtin_popcountll(horizontal) + __builtin_popcountll(vertical);
+
+    uint64_t fits = piece_fit_bits(board, pieces);
+    f.values[FEATURE_FITTING_PIECES] = __builtin_popcountll(fits);
+    for ( ; fits ; f.values[FEATURE_FITTING_SHAPES]++){
+        unsigned i = __builtin_ctzll(fits);
+        fits &= ~(pieces[i].rotations | (1ull << i));
+    }
+
+    return f;
+}
+
+
+// Weighted sum of the features; higher is better for the player.
+struct linear_evaluator{
+    float weights[FEATURE_COUNT] = {
+        -0.5f,      // filled
+        -4.0f,      // holes
+        1.0f,       // free 3x3 squares
+        1.5f,       // near full rows
+        1.5f,       // near full columns
+        -0.75f,     // transitions
+        0.25f,      // fitting pieces
+        2.0f,       // fitting shapes
+    };
+
+    float evaluate(const board_features& f) const {
+        float total = 0;
+        for (unsigned i = 0 ; i < FEATURE_COUNT ; i++){
+            total += weights[i] * f.values[i];
+        }
+        return total;
+    }
+
+    float evaluate(uint64_t board, const std::vector<piece_mask>& pieces) const {
+        return evaluate(extract_features(board, pieces));
+    }
+};
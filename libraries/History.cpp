@@ -0,0 +1,312 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+// One finished game. Fixed size so the history file is a plain array after
+// its header and can be mapped and indexed directly.
+struct game_record{
+    uint64_t seed = 0;
+    uint32_t score = 0;
+    uint32_t moves = 0;
+    uint32_t duration_ms = 0;
+    uint32_t lines_cleared = 0;
+    uint32_t max_combo = 0;
+    uint32_t reserved = 0;
+};
+static_assert(sizeof(game_record) == 32, "game_record layout changed");
+
+// Version 1 records, whose 16-bit line and combo counts overflowed in long
+// bot games. Files of that version are converted when next written to.
+struct game_record_v1{
+    uint64_t seed;
+    uint32_t score;
+    uint32_t moves;
+    uint32_t duration_ms;
+    uint16_t lines_cleared;
+    uint16_t max_combo;
+};
+static_assert(sizeof(game_record_v1) == 24, "game_record_v1 layout changed");
+
+const uint32_t HISTORY_VERSION = 2;
+
+struct history_header{
+    char magic[4] = {'T', 'B', 'H', 'S'};
+    uint32_t version = HISTORY_VERSION;
+    uint32_t record_size = sizeof(game_record);
+    uint32_t reserved = 0;
+};
+static_assert(sizeof(history_header) == 16, "history_header layout changed");
+
+// Scores below 64 get their own bucket; above that every power of two is split
+// into 64 buckets, so any percentile is within ~1.6% of the exact value.
+const unsigned HISTORY_SUB_BUCKETS = 64;
+const unsigned HISTORY_BUCKETS = 27 * HISTORY_SUB_BUCKETS;
+
+inline unsigned history_bucket(uint32_t value){
+    if (value < HISTORY_SUB_BUCKETS) return value;
+    unsigned e = 31 - __builtin_clz(value);
+    return (e - 5) * HISTORY_SUB_BUCKETS + ((value >> (e - 6)) & (HISTORY_SUB_BUCKETS - 1));
+}
+
+inline uint32_t history_bucket_floor(unsigned bucket){
+    if (bucket < 2 * HISTORY_SUB_BUCKETS) return bucket;
+    unsigned e = bucket / HISTORY_SUB_BUCKETS + 5;
+    return (uint32_t)(HISTORY_SUB_BUCKETS + bucket % HISTORY_SUB_BUCKETS) << (e - 6);
+}
+
+
+// Buffers records and appends them in batches. A record cut short by a crash
+// is dropped before the next append so the file stays aligned.
+class history_writer{
+private:
+    std::string path;
+    std::vector<game_record> pending;
+    size_t batch;
+    bool checked = false;
+
+    // Rewrites a version 1 file in the current format, through a temporary
+    // file so a crash leaves one or the other.
+    bool upgrade(uintmax_t size){
+        std::ifstream in(path, std::ios::binary);
+        in.seekg(sizeof(history_header));
+        std::vector<game_record_v1> old((size - sizeof(history_header)) / sizeof(game_record_v1));
+        if (!in.read((char*)old.data(), old.size() * sizeof(game_record_v1))) return false;
+        in.close();
+
+        std::vector<game_record> records(old.size());
+        for (size_t i = 0 ; i < old.size() ; i++){
+            records[i].seed = old[i].seed;
+            records[i].score = old[i].score;
+            records[i].moves = old[i].moves;
+            records[i].duration_ms = old[i].duration_ms;
+            records[i].lines_cleared = old[i].lines_cleared;
+            records[i].max_combo = old[i].max_combo;
+        }
+
+        std::string tmp_path = path + ".tmp";
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        history_header header;
+        out.write((const char*)&header, sizeof(header));
+        out.write((const char*)records.data(), records.size() * sizeof(game_record));
+        out.close();
+        return !out.fail() && std::rename(tmp_path.c_str(), path.c_str()) == 0;
+    }
+
+    // Makes the file ready for appending: creates it, converts an old
+    // version, or moves a file it can't append to out of the way.
+    void check(){
+        std::error_code ec;
+        uintmax_t size = std::filesystem::file_size(path, ec);
+        history_header header;
+        if (!ec && size >= sizeof(history_header)){
+            std::ifstream in(path, std::ios::binary);
+            in.read((char*)&header, sizeof(header));
+        }
+
+        history_header expected;
+        bool current = memcmp(header.magic, expected.magic, 4) == 0 && header.version == HISTORY_VERSION && header.record_size == sizeof(game_record);
+        bool old = memcmp(header.magic, expected.magic, 4) == 0 && header.version == 1 && header.record_size == sizeof(game_record_v1);
+
+        if (ec || size < sizeof(history_header)){
+            std::ofstream header_file(path, std::ios::binary | std::ios::trunc);
+            header_file.write((const char*)&expected, sizeof(expected));
+        }
+        else if (old){
+            size -= (size - sizeof(history_header)) % sizeof(game_record_v1);
+            if (!upgrade(size)){
+                std::cerr << "failed to convert the game history.\n";
+                return;
+            }
+        }
+        else if (!current){
+            std::filesystem::rename(path, path + ".old", ec);
+            std::cerr << "game history has an unknown format, moved to " << path << ".old\n";
+            std::ofstream header_file(path, std::ios::binary | std::ios::trunc);
+            header_file.write((const char*)&expected, sizeof(expected));
+        }
+        else if ((size - sizeof(history_header)) % sizeof(game_record) != 0){
+            std::filesystem::resize_file(path, size - (size - sizeof(history_header)) % sizeof(game_record), ec);
+        }
+        checked = true;
+    }
+
+public:
+    history_writer(std::string file_path, size_t batch_size = 256) : path(file_path), batch(batch_size) {
+        pending.reserve(batch);
+    }
+
+    ~history_writer(){
+        flush();
+    }
+
+    void append(const game_record& record){
+        pending.push_back(record);
+        if (pending.size() >= batch) flush();
+    }
+
+    // Creates or converts the file now rather than at the first append, so
+    // it can be read right away.
+    void open(){
+        if (!checked) check();
+    }
+
+    void flush(){
+        if (pending.empty()) return;
+
+        open();
+        if (!checked) return;       // keep the records for the next try
+
+        std::ofstream file(path, std::ios::binary | std::ios::app);
+        if (!file.is_open()){
+            std::cerr << "failed to open file for writing.\n";
+            return;
+        }
+        file.write((const char*)pending.data(), pending.size() * sizeof(game_record));
+        pending.clear();
+    }
+};
+
+
+// Read-only mapping of a history file.
+class history_view{
+private:
+    void* base = nullptr;
+    size_t length = 0;
+    const game_record* DATA = nullptr;
+    size_t COUNT = 0;
+
+public:
+    explicit history_view(const std::string& path){
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(history_header)){
+            length = st.st_size;
+            base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (base == MAP_FAILED){
+                base = nullptr;
+                length = 0;
+            }
+        }
+        close(fd);
+
+        if (!base) return;
+
+        history_header expected;
+        const history_header* header = (const history_header*)base;
+        if (memcmp(header->magic, expected.magic, 4) != 0){
+            munmap(base, length);
+            throw std::runtime_error("Error: Not a game history file!");
+        }
+        if (header->version != HISTORY_VERSION || header->record_size != sizeof(game_record)){
+            munmap(base, length);
+            throw std::runtime_error("Error: Game history file version " + std::to_string(header->version) + " is not supported!");
+        }
+
+        DATA = (const game_record*)((const char*)base + sizeof(history_header));
+        COUNT = (length - sizeof(history_header)) / sizeof(game_record);
+        madvise(base, length, MADV_SEQUENTIAL);
+    }
+
+    history_view(const history_view&) = delete;
+    history_view& operator=(const history_view&) = delete;
+
+    ~history_view(){
+        if (base) munmap(base, length);
+    }
+
+    size_t size() const { return COUNT; }
+    const game_record* begin() const { return DATA; }
+    const game_record* end() const { return DATA + COUNT; }
+    const game_record& operator[](size_t i) const { return DATA[i]; }
+};
+
+
+// Aggregates over the whole history. They are kept in a sidecar file together
+// with the number of records they cover, so opening the stats only has to fold
+// in the games played since the last visit.
+struct history_summary{
+    uint64_t games = 0;
+    uint64_t total_score = 0;
+    uint64_t total_moves = 0;
+    uint64_t total_lines = 0;
+    uint64_t total_duration_ms = 0;
+    uint32_t max_score = 0;
+    uint32_t max_combo = 0;
+    uint64_t buckets[HISTORY_BUCKETS] = {};
+
+    void add(const game_record& r){
+        games++;
+        total_score += r.score;
+        total_moves += r.moves;
+        total_lines += r.lines_cleared;
+        total_duration_ms += r.duration_ms;
+        if (r.score > max_score) max_score = r.score;
+        if (r.max_combo > max_combo) max_combo = r.max_combo;
+        buckets[history_bucket(r.score)]++;
+    }
+
+    double mean_score() const {
+        return games ? (double)total_score / games : 0;
+    }
+
+    // Lower bound of the bucket holding the q-th quantile.
+    uint32_t percentile(double q) const {
+        if (games == 0) return 0;
+        uint64_t rank = (uint64_t)(q * (games - 1));
+        uint64_t seen = 0;
+        for (unsigned i = 0 ; i < HISTORY_BUCKETS ; i++){
+            seen += buckets[i];
+            if (seen > rank) return history_bucket_floor(i);
+        }
+        return max_score;
+    }
+
+    // Number of games whose bucket starts in [low, high). Each bucket is
+    // counted by exactly one range, so adjacent ranges add up, but above 64
+    // the edges are only as exact as the buckets (~1.6%).
+    uint64_t count_between(uint32_t low, uint32_t high) const {
+        uint64_t n = 0;
+        for (unsigned i = history_bucket(low) ; i < HISTORY_BUCKETS && history_bucket_floor(i) < high ; i++){
+            if (history_bucket_floor(i) >= low) n += buckets[i];
+        }
+        return n;
+    }
+};
+
+inline history_summary load_history_summary(const std::string& history_path, const std::string& summary_path){
+    history_summary summary;
+
+    std::ifstream cached(summary_path, std::ios::binary);
+    if (!cached.read((char*)&summary, sizeof(summary))) summary = history_summary();
+
+    history_view view(history_path);
+    if (summary.games > view.size()) summary = history_summary();   // history was reset
+    if (summary.games == view.size()) return summary;
+
+    for (size_t i = summary.games ; i < view.size() ; i++){
+        summary.add(view[i]);
+    }
+
+    std::string tmp_path = summary_path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    out.write((const char*)&summary, sizeof(summary));
+    out.close();
+    if (!out.fail()) std::rename(tmp_path.c_str(), summary_path.c_str());
+
+    return summary;
+}
@@ -1,8 +1,25 @@
+#pragma once
+
 #include <stdexcept>
 #include <iostream>
 #include <iomanip>
 #include <random>
 #include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <type_traits>
+#include <limits>
+#include <charconv>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 template<typename T>
@@ -26,11 +43,257 @@ template<> struct AllowType<long double>        { static const bool allowed = tr
 template<> struct AllowType<bool>               { static const bool allowed = true; };
 
 
+// Allocation accounting, compiled in only with -DMATRIX_TRACK_ALLOCATIONS.
+// Every Matrix<T> instantiation keeps its own counters (not thread safe).
+struct matrix_counters {
+    unsigned long long allocations = 0;
+    unsigned long long bytes = 0;
+    unsigned long long copies = 0;
+    unsigned long long moves = 0;
+
+    matrix_counters operator-(const matrix_counters& other) const {
+        matrix_counters c;
+        c.allocations = allocations - other.allocations;
+        c.bytes = bytes - other.bytes;
+        c.copies = copies - other.copies;
+        c.moves = moves - other.moves;
+        return c;
+    }
+
+    friend std::ostream& operator<<(std::ostream& os, const matrix_counters& c){
+        os << c.allocations << " allocations, " << c.bytes << " bytes, " << c.copies << " copies, " << c.moves << " moves";
+        return os;
+    }
+};
+
+#ifdef MATRIX_TRACK_ALLOCATIONS
+#define MATRIX_COUNT(field, n) (counters().field += (n))
+#else
+#define MATRIX_COUNT(field, n) ((void)0)
+#endif
+
+
+// Binary matrix file: this header, then the elements in storage order in
+// native layout, starting at data_offset (a multiple of 2^alignment_log2, so
+// a mapped file can be used in place). Version 1 files are row major; the
+// column_major flag came with version 2, which is written only for column
+// major files so older readers refuse them instead of misreading them.
+struct matrix_file_header {
+    char magic[4] = {'M', 'T', 'R', 'X'};
+    uint8_t version = 1;
+    uint8_t type_kind = 0;          // 1 signed, 2 unsigned, 3 floating point, 4 bool
+    uint8_t element_size = 0;
+    uint8_t alignment_log2 = 6;
+    uint32_t byte_order = 0x01020304;
+    uint32_t rows = 0;
+    uint32_t cols = 0;
+    uint32_t data_offset = 0;
+    uint8_t column_major = 0;       // zero padding in version 1
+    uint8_t reserved[7] = {};
+};
+static_assert(sizeof(matrix_file_header) == 32, "matrix_file_header layout changed");
+
+template <typename T>
+constexpr uint8_t matrix_type_kind(){
+    if (std::is_same<T, bool>::value) return 4;
+    if (std::is_floating_point<T>::value) return 3;
+    return std::is_signed<T>::value ? 1 : 2;
+}
+
+// Storage orders for Matrix. Row major (the default) keeps each row
+// contiguous, column major each column, as Fortran, BLAS and LAPACK do.
+struct RowMajor {
+    static constexpr bool row_major = true;
+    static size_t index(unsigned row, unsigned col, unsigned, unsigned cols){ return (size_t)row * cols + col; }
+};
+
+struct ColumnMajor {
+    static constexpr bool row_major = false;
+    static size_t index(unsigned row, unsigned col, unsigned rows, unsigned){ return (size_t)col * rows + row; }
+};
+
+template <typename T, typename Layout = RowMajor>
+class MappedMatrix;
+
 template <typename T>
+class LUDecomposition;
+
+
+template <typename T, typename Layout = RowMajor>
 class Matrix{
 private:
     unsigned ROWS, COLS, SIZE;
     T* DATA;
+    bool OWNED = true;      // false for a view over memory someone else owns
+
+    friend class MappedMatrix<T, Layout>;
+    template <typename U, typename L> friend class Matrix;
+
+    // View over existing elements, never freed by the matrix. The tag keeps
+    // Matrix(rows, cols, 0) meaning a filled matrix, not a view of nullptr.
+    struct view_tag{};
+    Matrix(view_tag, unsigned r, unsigned c, T* data) : ROWS(r), COLS(c), SIZE(r * c), DATA(data), OWNED(false) {}
+
+    size_t index(unsigned row, unsigned col) const { return Layout::index(row, col, ROWS, COLS); }
+
+    // One value from text, or nullptr if there is no valid number at p.
+    static const char* parse_value(const char* p, const char* end, T& value){
+        if constexpr (std::is_same<T, bool>::value) {
+            if (p == end || (*p != '0' && *p != '1')) return nullptr;
+            value = *p == '1';
+            return p + 1;
+        } else {
+            auto result = std::from_chars(p, end, value);
+            return result.ec == std::errc() ? result.ptr : nullptr;
+        }
+    }
+
+    static char* format_value(char* p, char* end, T value){
+        if constexpr (std::is_same<T, bool>::value) {
+            *p = value ? '1' : '0';
+            return p + 1;
+        } else {
+            return std::to_chars(p, end, value).ptr;
+        }
+    }
+
+    static const char* skip_blanks(const char* p, const char* end){
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        return p;
+    }
+
+    // Parses rows [first, last) into DATA. Returns an error message with its
+    // line and column, or an empty string.
+    std::string parse_rows(const char* text, const std::vector<size_t>& starts, const std::vector<size_t>& ends,
+                           const std::vector<size_t>& line_numbers, unsigned first, unsigned last, char delimiter){
+        bool blank_separated = delimiter == ' ' || delimiter == '\t';
+        for (unsigned i = first ; i < last ; i++){
+            const char* line = text + starts[i];
+            const char* end = text + ends[i];
+            const char* p = skip_blanks(line, end);
+
+            auto error = [&](const std::string& message){
+                return "Error: line " + std::to_string(line_numbers[i]) + ", column " + std::to_string(p - line + 1) + ": " + message;
+            };
+
+            for (unsigned j = 0 ; j < COLS ; j++){
+                if (p == end){
+                    return error("expected " + std::to_string(COLS) + " values, found " + std::to_string(j));
+                }
+                const char* next = parse_value(p, end, DATA[index(i, j)]);
+                if (!next || (blank_separated && next < end && *next != ' ' && *next != '\t')){
+                    return error("invalid number");
+                }
+                p = skip_blanks(next, end);
+                if (!blank_separated && j + 1 < COLS){
+                    if (p == end || *p != delimiter){
+                        return error(p == end ? "expected " + std::to_string(COLS) + " values, found " + std::to_string(j + 1)
+                                              : std::string("expected '") + delimiter + "'");
+                    }
+                    p = skip_blanks(p + 1, end);
+                }
+            }
+            if (p != end){
+                return error("more than " + std::to_string(COLS) + " values");
+            }
+        }
+        return "";
+    }
+
+    static matrix_file_header check_header(const matrix_file_header& h, size_t file_size, const std::string& path){
+        matrix_file_header expected;
+        if (memcmp(h.magic, expected.magic, 4) != 0 || (h.version != 1 && h.version != 2) || h.byte_order != expected.byte_order){
+            throw std::runtime_error("Error: Not a matrix file (or from another platform): " + path);
+        }
+        if (h.type_kind != matrix_type_kind<T>() || h.element_size != sizeof(T)){
+            throw std::runtime_error("Error: Matrix file holds another element type: " + path);
+        }
+        // Both sizes are 32 bit, so their product fits in 64 bits; it must
+        // also fit SIZE, and the bytes are compared without adding to the offset.
+        uint64_t elements = (uint64_t)h.rows * h.cols;
+        if (h.rows == 0 || h.cols == 0 || elements > std::numeric_limits<unsigned>::max()){
+            throw std::runtime_error("Error: Bad matrix size in " + path);
+        }
+        if (h.data_offset < sizeof(h) || h.data_offset % alignof(T) != 0){
+            throw std::runtime_error("Error: Bad data offset in matrix file: " + path);
+        }
+        if (h.data_offset > file_size || elements * sizeof(T) > file_size - h.data_offset){
+            throw std::runtime_error("Error: Truncated matrix file: " + path);
+        }
+        matrix_file_header checked = h;
+        if (checked.version == 1) checked.column_major = 0;
+        return checked;
+    }
+
+    // Counter based generator: the value at index of a stream is a
+    // splitmix64 hash of the two, so a fill is a plain loop over indices that
+    // the compiler can vectorize, and any part of it can be made on its own
+    // thread with the same result.
+    static uint64_t random_bits(uint64_t stream, uint64_t index){
+        uint64_t z = stream + (index + 1) * 0x9E3779B97F4A7C15ull;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    // High 64 bits of the 128 bit product, from 32 bit halves so it needs no
+    // compiler extension. The middle sum can't overflow.
+    static uint64_t multiply_high(uint64_t a, uint64_t b){
+        uint64_t a_low = a & 0xFFFFFFFFull, a_high = a >> 32;
+        uint64_t b_low = b & 0xFFFFFFFFull, b_high = b >> 32;
+        uint64_t low_high = a_low * b_high, high_low = a_high * b_low;
+        uint64_t middle = ((a_low * b_low) >> 32) + (high_low & 0xFFFFFFFFull) + low_high;
+        return a_high * b_high + (high_low >> 32) + (middle >> 32);
+    }
+
+    // Elements [first, last) of the stream, uniform in [min, max) for
+    // floating point T and in [min, max] for integers.
+    static void random_fill(T* out, size_t first, size_t last, T min, T max, uint64_t stream){
+        if constexpr (std::is_same<T, bool>::value) {
+            bool on = min || max;
+            for (size_t i = first ; i < last ; i++){
+                out[i] = on && (random_bits(stream, i) >> 63);
+            }
+        } else if constexpr (std::is_floating_point<T>::value) {
+            // As many random bits as T holds exactly (53 at most), so the
+            // value before scaling is below 1.
+            constexpr unsigned bits = std::numeric_limits<T>::digits < 53 ? std::numeric_limits<T>::digits : 53;
+            T scale = (max - min) / (T)(1ull << bits);
+            for (size_t i = first ; i < last ; i++){
+                out[i] = min + scale * (T)(random_bits(stream, i) >> (64 - bits));
+            }
+        } else {
+            // Multiply-shift into the range: the bias is at most range / 2^64.
+            uint64_t range = (uint64_t)max - (uint64_t)min + 1;
+            for (size_t i = first ; i < last ; i++){
+                uint64_t bits = random_bits(stream, i);
+                uint64_t offset = range ? multiply_high(bits, range) : bits;
+                out[i] = (T)((uint64_t)min + offset);
+            }
+        }
+    }
+
+    // A stream from a seed. Without one, a new stream from the shared
+    // clock seeded generator.
+    static uint64_t random_stream(const uint64_t* seed){
+        static std::mt19937_64 rng(std::chrono::steady_clock::now().time_since_epoch().count());
+        uint64_t s = seed ? *seed : rng();
+        return random_bits(s, 0);
+    }
+
+    void fill_random_stream(T min, T max, uint64_t stream, unsigned threads){
+        if (threads < 1) threads = 1;
+        if (threads == 1 || SIZE < (1u << 16)){
+            random_fill(DATA, 0, SIZE, min, max, stream);
+            return;
+        }
+        std::vector<std::thread> workers;
+        for (unsigned t = 0 ; t < threads ; t++){
+            size_t first = (size_t)SIZE * t / threads, last = (size_t)SIZE * (t + 1) / threads;
+            workers.emplace_back(random_fill, DATA, first, last, min, max, stream);
+        }
+        for (std::thread& w : workers) w.join();
+    }
 
 public:
     // For subscript operator "[]"
@@ -38,22 +301,23 @@ public:
     private:
         T* row_data;
         unsigned cols;
+        size_t stride;      // distance between elements of a row
     public:
-        RowProxy(T* data, unsigned c) : row_data(data), cols(c) {}
+        RowProxy(T* data, unsigned c, size_t s = 1) : row_data(data), cols(c), stride(s) {}
 
         T& operator[](unsigned col){
             if (col >= cols) {
                 throw std::runtime_error("Error: Invalid column index");
             }
             
-            return row_data[col];
+            return row_data[col * stride];
         }
         const T& operator[](unsigned col) const {
             if (col >= cols) {
                 throw std::runtime_error("Error: Invalid column index");
             }
 
-            return row_data[col];
+            return row_data[col * stride];
         }
     };
 
@@ -79,6 +343,11 @@ public:
         }
     }
 
+    static matrix_counters& counters(){
+        static matrix_counters c;
+        return c;
+    }
+
     static void swap(unsigned& a, unsigned& b){
         unsigned temp = a;
         a = b;
@@ -92,6 +361,8 @@ public:
         COLS = c;
         SIZE = r*c;
         DATA = new T[SIZE]{};
+        MATRIX_COUNT(allocations, 1);
+        MATRIX_COUNT(bytes, SIZE * sizeof(T));
         if (value != T()){
             for (unsigned i = 0 ; i < SIZE ; i++){
                 DATA[i] = value;
@@ -102,6 +373,9 @@ public:
     // Copy Constructor
     Matrix(const Matrix& other) : ROWS(other.ROWS), COLS(other.COLS), SIZE(other.SIZE) {
         DATA = new T[SIZE];
+        MATRIX_COUNT(allocations, 1);
+        MATRIX_COUNT(bytes, SIZE * sizeof(T));
+        MATRIX_COUNT(copies, 1);
         for (unsigned i = 0; i < SIZE; ++i) {
             DATA[i] = other.DATA[i];
         }
@@ -110,11 +384,15 @@ public:
     // Copy Assignment Operator
     Matrix& operator=(const Matrix& other) {
         if (this != &other) {
-            delete[] DATA;
+            if (OWNED) delete[] DATA;
             ROWS = other.ROWS;
             COLS = other.COLS;
             SIZE = other.SIZE;
             DATA = new T[SIZE];
+            OWNED = true;
+            MATRIX_COUNT(allocations, 1);
+            MATRIX_COUNT(bytes, SIZE * sizeof(T));
+            MATRIX_COUNT(copies, 1);
             for (unsigned i = 0; i < SIZE; ++i) {
                 DATA[i] = other.DATA[i];
             }
@@ -123,16 +401,19 @@ public:
     }
 
     // Move Constructor
-    Matrix(Matrix&& other) noexcept : ROWS(other.ROWS), COLS(other.COLS), SIZE(other.SIZE), DATA(other.DATA) {
+    Matrix(Matrix&& other) noexcept : ROWS(other.ROWS), COLS(other.COLS), SIZE(other.SIZE), DATA(other.DATA), OWNED(other.OWNED) {
+        MATRIX_COUNT(moves, 1);
         other.DATA = nullptr;
         other.ROWS = other.COLS = other.SIZE = 0;
     }
 
     // Move Assignment Operator
     Matrix& operator=(Matrix&& other) noexcept {
+        MATRIX_COUNT(moves, 1);
         if (this != &other) {
-            delete[] DATA;
+            if (OWNED) delete[] DATA;
             DATA = other.DATA;
+            OWNED = other.OWNED;
             ROWS = other.ROWS;
             COLS = other.COLS;
             SIZE = other.SIZE;
@@ -144,19 +425,24 @@ public:
     
     // Destructor
     ~Matrix(){
-        delete[] DATA;
+        if (OWNED) delete[] DATA;
     }
 
     unsigned get_rows() const { return ROWS; }
     unsigned get_cols() const { return COLS; }
     unsigned get_size() const { return SIZE; }
 
+    // The elements in storage order (row by row, or column by column for
+    // ColumnMajor), for code that needs them in bulk.
+    T* data() { return DATA; }
+    const T* data() const { return DATA; }
+
     T get(unsigned row, unsigned column) const {
         if (row >= ROWS || column >= COLS){
             throw std::runtime_error("Error: Invalid index!");
         }
 
-        return DATA[row * COLS + column];
+        return DATA[index(row, column)];
     }
 
     void set(unsigned row, unsigned column, T new_data){
@@ -164,7 +450,7 @@ public:
             throw std::runtime_error("Error: Invalid index!");
         }
 
-        DATA[row * COLS + column] = new_data;
+        DATA[index(row, column)] = new_data;
     }
 
     void resize(unsigned r, unsigned c){
@@ -173,17 +459,20 @@ public:
         }
         
         T* newData = new T[r * c]{};
+        MATRIX_COUNT(allocations, 1);
+        MATRIX_COUNT(bytes, r * c * sizeof(T));
         unsigned minRows = (r < ROWS) ? r : ROWS;
         unsigned minCols = (c < COLS) ? c : COLS;
         
         for (unsigned i = 0; i < minRows; ++i) {
             for (unsigned j = 0; j < minCols; ++j) {
-                newData[i * c + j] = DATA[i * COLS + j];
+                newData[Layout::index(i, j, r, c)] = DATA[index(i, j)];
             }
         }
         
-        delete[] DATA;
+        if (OWNED) delete[] DATA;
         DATA = newData;
+        OWNED = true;
         ROWS = r;
         COLS = c;
         SIZE = r * c;
@@ -193,18 +482,19 @@ public:
         for (unsigned i = 0 ; i < ROWS ; i++){
             std::cout << "| ";
             for (unsigned j = 0 ; j < COLS ; j++){
-                std::cout << std::setw(width) << DATA[i * COLS + j] << " ";
+                std::cout << std::setw(width) << DATA[index(i, j)] << " ";
             }
             std::cout << "|" << std::endl;
         }
     }
 
+    // Values in row order, whatever the storage order.
     template <unsigned N>
     void insert_data(T (&arr)[N]){
         unsigned minSize = (N < SIZE) ? N : SIZE;
 
         for (unsigned i = 0 ; i < minSize ; i++){
-            DATA[i] = arr[i];
+            DATA[index(i / COLS, i % COLS)] = arr[i];
         }
 
         if (N > SIZE){
@@ -227,7 +517,7 @@ public:
             throw std::runtime_error("Error: Size mismatch!");
         }
 
-        Matrix<T> M(ROWS, COLS);
+        Matrix M(ROWS, COLS);
 
         for (unsigned i = 0 ; i < SIZE ; i++){
             M.DATA[i] = DATA[i] + m.DATA[i];
@@ -243,7 +533,7 @@ public:
     }
     
     Matrix return_add_scalar(T scalar){
-        Matrix<T> M(ROWS, COLS);
+        Matrix M(ROWS, COLS);
 
         for (unsigned i = 0 ; i < SIZE ; i++){
             M.DATA[i] = DATA[i] + scalar;
@@ -267,7 +557,7 @@ public:
             throw std::runtime_error("Error: Size mismatch!");
         }
 
-        Matrix<T> M(ROWS, COLS);
+        Matrix M(ROWS, COLS);
 
         for (unsigned i = 0 ; i < SIZE ; i++){
             M.DATA[i] = DATA[i] - m.DATA[i];
@@ -289,53 +579,50 @@ public:
             throw std::runtime_error("Error: Can't multiply!");
         }
 
-        Matrix<T> M(ROWS, m.COLS);
-
-        for (unsigned i = 0 ; i < ROWS ; i++){
-            for (unsigned j = 0 ; j < m.COLS ; j++){
-                T value = T();
-                for (unsigned k = 0 ; k < COLS ; k++){
-                    value += get(i, k) * m.get(k, j);
-                }
-                M.set(i, j, value);
-            }
-        }
-
+        Matrix M(ROWS, m.COLS);
+        multiply_into(m, M);
         return M;
     }
 
     void transpose(){
-        Matrix<T> M(COLS, ROWS);
-
-        for (unsigned i = 0 ; i < COLS ; i++){
-            for (unsigned j = 0 ; j < ROWS ; j++){
-                M.set(i, j, get(j, i));
-            }
-        }
-
-        resize(COLS, ROWS);
-
-        for (unsigned i = 0 ; i < ROWS ; i++){
-            for (unsigned j = 0 ; j < COLS ; j++){
-                set(i, j, M.get(i, j));
-            }
-        }
+        *this = return_transpose();
     }
 
     Matrix return_transpose() const {
-        Matrix<T> M(COLS, ROWS);
+        Matrix M(COLS, ROWS);
+        transpose_elements(DATA, M.DATA, lines(), line_length());
+        return M;
+    }
 
-        for (unsigned i = 0 ; i < COLS ; i++){
-            for (unsigned j = 0 ; j < ROWS ; j++){
-                M.set(i, j, get(j, i));
-            }
+    // The same matrix in storage order L. Between orders this is a tiled
+    // transpose of the elements.
+    template <typename L>
+    Matrix<T, L> to_layout() const {
+        Matrix<T, L> M(ROWS, COLS);
+        if constexpr (std::is_same<L, Layout>::value) {
+            std::copy(DATA, DATA + SIZE, M.DATA);
+        } else {
+            transpose_elements(DATA, M.DATA, lines(), line_length());
         }
+        return M;
+    }
 
+    // The transpose in the other storage order, which holds the same
+    // elements in the same places: it takes them over without copying,
+    // leaving this matrix empty. Data from a column major source can be
+    // read as a row major matrix of the transposed size and relabelled.
+    auto release_transpose() && {
+        using Other = typename std::conditional<Layout::row_major, ColumnMajor, RowMajor>::type;
+        Matrix<T, Other> M(COLS, ROWS, DATA);
+        M.OWNED = OWNED;
+        DATA = nullptr;
+        OWNED = true;
+        ROWS = COLS = SIZE = 0;
         return M;
     }
     
     Matrix operator+(T scalar) const{
-        Matrix<T> M(ROWS, COLS);
+        Matrix M(ROWS, COLS);
         for (unsigned i = 0 ; i < M.SIZE ; i++){
             M.DATA[i] = DATA[i] + scalar;
         }
@@ -347,7 +634,7 @@ public:
     }
     
     Matrix operator-(T scalar) const{
-        Matrix<T> M(ROWS, COLS);
+        Matrix M(ROWS, COLS);
         for (unsigned i = 0 ; i < M.SIZE ; i++){
             M.DATA[i] = DATA[i] - scalar;
         }
@@ -359,7 +646,7 @@ public:
     }
     
     Matrix operator*(T scalar) const{
-        Matrix<T> M(ROWS, COLS);
+        Matrix M(ROWS, COLS);
         for (unsigned i = 0 ; i < M.SIZE ; i++){
             M.DATA[i] = DATA[i] * scalar;
         }
@@ -374,7 +661,7 @@ public:
         if (scalar == 0) {
             throw std::runtime_error("Error: Division by zero!");
         }
-        Matrix<T> M(ROWS, COLS);
+        Matrix M(ROWS, COLS);
         for (unsigned i = 0 ; i < M.SIZE ; i++){
             M.DATA[i] = DATA[i] / scalar;
         }
@@ -426,19 +713,9 @@ public:
             throw std::runtime_error("Error: Can't multiply!");
         }
 
-        Matrix<T> M(ROWS, m.COLS);
-
-        for (unsigned i = 0 ; i < ROWS ; i++){
-            for (unsigned j = 0 ; j < m.COLS ; j++){
-                T value = T();
-                for (unsigned k = 0 ; k < COLS ; k++){
-                    value += get(i, k) * m.get(k, j);
-                }
-                M.set(i, j, value);
-            }
-        }
-
-        *this = M;
+        Matrix M(ROWS, m.COLS);
+        multiply_into(m, M);
+        *this = std::move(M);
 
         return *this;
     }
@@ -460,13 +737,22 @@ public:
         return *this;
     }
     
-    // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-    // This  will  be  implemented in future
-    // Matrix& operator/=(const Matrix& m){}
-    // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+    // Right division, *this times the inverse of m, computed by solving
+    // X m = *this through the LU decomposition of m.
+    Matrix& operator/=(const Matrix& m){
+        *this = *this / m;
+        return *this;
+    }
+
+    Matrix operator/(const Matrix& m) const {
+        if (m.ROWS != m.COLS || COLS != m.ROWS){
+            throw std::runtime_error("Error: Can't divide!");
+        }
+        return LUDecomposition<T>(m.return_transpose()).solve(return_transpose()).return_transpose();
+    }
     
     Matrix operator-() const {
-        Matrix<T> M(ROWS, COLS);
+        Matrix M(ROWS, COLS);
         for (unsigned i = 0 ; i < SIZE ; i++){
             M.DATA[i] = -DATA[i];
         }
@@ -474,7 +760,7 @@ public:
     }
     
     Matrix operator+() const {
-        Matrix<T> M(ROWS, COLS);
+        Matrix M(ROWS, COLS);
         for (unsigned i = 0 ; i < SIZE ; i++){
             M.DATA[i] = DATA[i];
         }
@@ -514,12 +800,12 @@ public:
     // bool operator!(const Matrix& m){}
     // !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
     
-    Matrix<bool> operator<(const Matrix<T>& m) const {
+    Matrix<bool, Layout> operator<(const Matrix& m) const {
         if (ROWS != m.ROWS || COLS != m.COLS){
             throw std::runtime_error("Error: Size mismatch!");
         }
         
-        Matrix<bool> M(ROWS, COLS);
+        Matrix<bool, Layout> M(ROWS, COLS);
 
         for (unsigned i = 0 ; i < SIZE ; i++){
             M.DATA[i] = DATA[i] < m.DATA[i];
@@ -528,8 +814,8 @@ public:
         return M;
     }
     
-    Matrix<bool> operator<(T scalar) const {        
-        Matrix<bool> M(ROWS, COLS);
+    Matrix<bool, Layout> operator<(T scalar) const {        
+        Matrix<bool, Layout> M(ROWS, COLS);
 
         for (unsigned i = 0 ; i < SIZE ; i++){
             M.DATA[i] = DATA[i] < scalar;
@@ -538,12 +824,12 @@ public:
         return M;
     }
     
-    Matrix<bool> operator>(const Matrix<T>& m) const {
+    Matrix<bool, Layout> operator>(const Matrix& m) const {
         if (ROWS != m.ROWS || COLS != m.COLS){
             throw std::runtime_error("Error: Size mismatch!");
         }
         
-        Matrix<bool> M(ROWS, COLS);
+        Matrix<bool, Layout> M(ROWS, COLS);
         
         for (unsigned i = 0 ; i < SIZE ; i++){
             M.DATA[i] = DATA[i] > m.DATA[i];
@@ -552,8 +838,8 @@ public:
         return M;
     }
     
-    Matrix<bool> operator>(T scalar) const {        
-        Matrix<bool> M(ROWS, COLS);
+    Matrix<bool, Layout> operator>(T scalar) const {        
+        Matrix<bool, Layout> M(ROWS, COLS);
 
         for (unsigned i = 0 ; i < SIZE ; i++){
             M.DATA[i] = DATA[i] > scalar;
@@ -562,12 +848,12 @@ public:
         return M;
     }
     
-    Matrix<bool> operator<=(const Matrix<T>& m) const {
+    Matrix<bool, Layout> operator<=(const Matrix& m) const {
         if (ROWS != m.ROWS || COLS != m.COLS){
             throw std::runtime_error("Error: Size mismatch!");
         }
 
-        Matrix<bool> M(ROWS, COLS);
+        Matrix<bool, Layout> M(ROWS, COLS);
 
         for (unsigned i = 0 ; i < SIZE ; i++){
             M.DATA[i] = DATA[i] <= m.DATA[i];
@@ -576,8 +862,8 @@ public:
         return M;
     }
     
-    Matrix<bool> operator<=(T scalar) const {        
-        Matrix<bool> M(ROWS, COLS);
+    Matrix<bool, Layout> operator<=(T scalar) const {        
+        Matrix<bool, Layout> M(ROWS, COLS);
 
         for (unsigned i = 0 ; i < SIZE ; i++){
             M.DATA[i] = DATA[i] <= scalar;
@@ -586,12 +872,12 @@ public:
         return M;
     }
     
-    Matrix<bool> operator>=(const Matrix<T>& m) const {
+    Matrix<bool, Layout> operator>=(const Matrix& m) const {
         if (ROWS != m.ROWS || COLS != m.COLS){
             throw std::runtime_error("Error: Size mismatch!");
         }
 
-        Matrix<bool> M(ROWS, COLS);
+        Matrix<bool, Layout> M(ROWS, COLS);
 
         for (unsigned i = 0 ; i < SIZE ; i++){
             M.DATA[i] = DATA[i] >= m.DATA[i];
@@ -600,8 +886,8 @@ public:
         return M;
     }
     
-    Matrix<bool> operator>=(T scalar) const {        
-        Matrix<bool> M(ROWS, COLS);
+    Matrix<bool, Layout> operator>=(T scalar) const {        
+        Matrix<bool, Layout> M(ROWS, COLS);
 
         for (unsigned i = 0 ; i < SIZE ; i++){
             M.DATA[i] = DATA[i] >= scalar;
@@ -610,12 +896,12 @@ public:
         return M;
     }
     
-    Matrix<bool> operator==(const Matrix<T>& m) const {
+    Matrix<bool, Layout> operator==(const Matrix& m) const {
         if (ROWS != m.ROWS || COLS != m.COLS){
             throw std::runtime_error("Error: Size mismatch!");
         }
 
-        Matrix<bool> M(ROWS, COLS);
+        Matrix<bool, Layout> M(ROWS, COLS);
 
         for (unsigned i = 0 ; i < SIZE ; i++){
             M.DATA[i] = DATA[i] == m.DATA[i];
@@ -624,8 +910,8 @@ public:
         return M;
     }
     
-    Matrix<bool> operator==(T scalar) const {        
-        Matrix<bool> M(ROWS, COLS);
+    Matrix<bool, Layout> operator==(T scalar) const {        
+        Matrix<bool, Layout> M(ROWS, COLS);
 
         for (unsigned i = 0 ; i < SIZE ; i++){
             M.DATA[i] = DATA[i] == scalar;
@@ -634,12 +920,12 @@ public:
         return M;
     }
     
-    Matrix<bool> operator!=(const Matrix<T>& m) const {
+    Matrix<bool, Layout> operator!=(const Matrix& m) const {
         if (ROWS != m.ROWS || COLS != m.COLS){
             throw std::runtime_error("Error: Size mismatch!");
         }
 
-        Matrix<bool> M(ROWS, COLS);
+        Matrix<bool, Layout> M(ROWS, COLS);
 
         for (unsigned i = 0 ; i < SIZE ; i++){
             M.DATA[i] = DATA[i] != m.DATA[i];
@@ -648,8 +934,8 @@ public:
         return M;
     }
     
-    Matrix<bool> operator!=(T scalar) const {        
-        Matrix<bool> M(ROWS, COLS);
+    Matrix<bool, Layout> operator!=(T scalar) const {        
+        Matrix<bool, Layout> M(ROWS, COLS);
 
         for (unsigned i = 0 ; i < SIZE ; i++){
             M.DATA[i] = DATA[i] != scalar;
@@ -658,12 +944,12 @@ public:
         return M;
     }
     
-    Matrix operator&(const Matrix<T>& m) const {
+    Matrix operator&(const Matrix& m) const {
         if (ROWS != m.ROWS || COLS != m.COLS){
             throw std::runtime_error("Error: Size mismatch!");
         }
 
-        Matrix<T> M(ROWS, COLS);
+        Matrix M(ROWS, COLS);
 
         for (unsigned i = 0 ; i < SIZE ; i++){
             M.DATA[i] = DATA[i] & m.DATA[i];
@@ -682,7 +968,7 @@ public:
         return M;
     }
     
-    Matrix operator|(const Matrix<T>& m) const {
+    Matrix operator|(const Matrix& m) const {
         if (ROWS != m.ROWS || COLS != m.COLS){
             throw std::runtime_error("Error: Size mismatch!");
         }
@@ -706,7 +992,7 @@ public:
         return M;
     }
     
-    Matrix operator^(const Matrix<T>& m) const {
+    Matrix operator^(const Matrix& m) const {
         if (ROWS != m.ROWS || COLS != m.COLS){
             throw std::runtime_error("Error: Size mismatch!");
         }
@@ -740,7 +1026,7 @@ public:
         return M;
     }
     
-    Matrix& operator&=(const Matrix<T>& m){
+    Matrix& operator&=(const Matrix& m){
         if (ROWS != m.ROWS || COLS != m.COLS){
             throw std::runtime_error("Error: Size mismatch!");
         }
@@ -760,7 +1046,7 @@ public:
         return *this;
     }
 
-    Matrix& operator|=(const Matrix<T>& m){
+    Matrix& operator|=(const Matrix& m){
         if (ROWS != m.ROWS || COLS != m.COLS){
             throw std::runtime_error("Error: Size mismatch!");
         }
@@ -780,7 +1066,7 @@ public:
         return *this;
     }
 
-    Matrix& operator^=(const Matrix<T>& m){
+    Matrix& operator^=(const Matrix& m){
         if (ROWS != m.ROWS || COLS != m.COLS){
             throw std::runtime_error("Error: Size mismatch!");
         }
@@ -805,7 +1091,7 @@ public:
             throw std::runtime_error("Error: Invalid row index!");
         }
 
-        return RowProxy(DATA + row * COLS, COLS);
+        return RowProxy(DATA + index(row, 0), COLS, index(0, 1));
     }
 
     const RowProxy operator[](unsigned row) const {
@@ -813,7 +1099,7 @@ public:
             throw std::runtime_error("Error: Invalid row index!");
         }
 
-        return RowProxy(DATA + row * COLS, COLS);
+        return RowProxy(DATA + index(row, 0), COLS, index(0, 1));
     }
 
     T& operator()(unsigned row, unsigned col){
@@ -821,7 +1107,7 @@ public:
             throw std::runtime_error("Error: Invalid index!");
         }
 
-        return DATA[row * COLS + col];
+        return DATA[index(row, col)];
     }
 
     const T& operator()(unsigned row, unsigned col) const {
@@ -829,15 +1115,15 @@ public:
             throw std::runtime_error("Error: Invalid index!");
         }
 
-        return DATA[row * COLS + col];
+        return DATA[index(row, col)];
     }
 
-    friend std::ostream& operator<<(std::ostream& os, const Matrix<T>& m){
+    friend std::ostream& operator<<(std::ostream& os, const Matrix& m){
         unsigned rows = m.get_rows(), cols = m.get_cols();
         for (unsigned i = 0 ; i < rows ; i++){
             os << "| ";
             for (unsigned j = 0 ; j < cols ; j++){
-                os << std::setw(6) << m.DATA[i * cols + j] << " ";
+                os << std::setw(6) << m.DATA[m.index(i, j)] << " ";
             }
             os << "|";
             if (i < rows - 1){ 
@@ -847,7 +1133,7 @@ public:
         return os;
     }
 
-    friend std::istream& operator>>(std::istream& is, Matrix<T>& m) {
+    friend std::istream& operator>>(std::istream& is, Matrix& m) {
         unsigned rows = m.get_rows(), cols = m.get_cols();
         for (unsigned i = 0; i < rows; i++) {
             for (unsigned j = 0; j < cols; j++) {
@@ -856,42 +1142,216 @@ public:
                 if (is.fail()) {
                     throw std::runtime_error("Error: Invalid input!");
                 }
-                m.DATA[i * cols + j] = value;
+                m.DATA[m.index(i, j)] = value;
             }
         }
         return is;
     }
 
-    static Matrix<T> identity_matrix(unsigned size){
-        Matrix<T> M(size, size);
+    // Bulk text import: one row per line, values separated by delimiter (','
+    // for CSV; ' ' or '\t' for any run of blanks), blank lines ignored. The
+    // size comes from the text. Numbers are parsed with std::from_chars, and
+    // with threads > 1 the rows are split between that many threads. Errors
+    // name the line and column.
+    static Matrix parse_text(const char* text, size_t length, char delimiter = ',', unsigned threads = 1){
+        std::vector<size_t> starts, ends, line_numbers;
+        size_t line_number = 0;
+        for (size_t pos = 0 ; pos < length ; ){
+            const char* newline = (const char*)memchr(text + pos, '\n', length - pos);
+            size_t end = newline ? newline - text : length;
+            size_t trimmed = (end > pos && text[end - 1] == '\r') ? end - 1 : end;
+            line_number++;
+
+            if (skip_blanks(text + pos, text + trimmed) != text + trimmed){
+                starts.push_back(pos);
+                ends.push_back(trimmed);
+                line_numbers.push_back(line_number);
+            }
+            pos = end + 1;
+        }
+        if (starts.empty()){
+            throw std::runtime_error("Error: No rows in the text!");
+        }
+
+        // Columns are counted on the first row.
+        unsigned cols = 0;
+        const char* end = text + ends[0];
+        for (const char* p = skip_blanks(text + starts[0], end) ; p < end ; cols++){
+            if (delimiter == ' ' || delimiter == '\t'){
+                while (p < end && *p != ' ' && *p != '\t') p++;
+                p = skip_blanks(p, end);
+            }
+            else{
+                const char* next = (const char*)memchr(p, delimiter, end - p);
+                p = next ? next + 1 : end;
+                if (next && p == end) cols++;      // empty value after the last delimiter
+            }
+        }
+
+        Matrix M(starts.size(), cols);
+        unsigned rows = starts.size();
+        if (threads < 1) threads = 1;
+        if (threads > rows) threads = rows;
+
+        std::vector<std::string> errors(threads);
+        if (threads == 1){
+            errors[0] = M.parse_rows(text, starts, ends, line_numbers, 0, rows, delimiter);
+        }
+        else{
+            std::vector<std::thread> workers;
+            for (unsigned t = 0 ; t < threads ; t++){
+                unsigned first = (unsigned long long)rows * t / threads, last = (unsigned long long)rows * (t + 1) / threads;
+                workers.emplace_back([&, t, first, last](){
+                    errors[t] = M.parse_rows(text, starts, ends, line_numbers, first, last, delimiter);
+                });
+            }
+            for (std::thread& w : workers) w.join();
+        }
+
+        for (const std::string& e : errors){
+            if (!e.empty()) throw std::runtime_error(e);
+        }
+        return M;
+    }
+
+    static Matrix load_text(const std::string& path, char delimiter = ',', unsigned threads = 1){
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file.is_open()){
+            throw std::runtime_error("Error: Can't open " + path);
+        }
+        std::string text(file.tellg(), '\0');
+        file.seekg(0);
+        if (!file.read(&text[0], text.size())){
+            throw std::runtime_error("Error: Failed to read " + path);
+        }
+        return parse_text(text.data(), text.size(), delimiter, threads);
+    }
+
+    // Bulk text export in the format parse_text reads: shortest round-trip
+    // numbers from std::to_chars, written in large blocks.
+    void write_text(std::ostream& os, char delimiter = ',') const {
+        const size_t block = 1 << 20;
+        std::vector<char> buffer(block + 128);
+        char* p = buffer.data();
+
+        for (unsigned i = 0 ; i < ROWS ; i++){
+            for (unsigned j = 0 ; j < COLS ; j++){
+                if (j) *p++ = delimiter;
+                p = format_value(p, buffer.data() + buffer.size(), DATA[index(i, j)]);
+                if ((size_t)(p - buffer.data()) >= block){
+                    os.write(buffer.data(), p - buffer.data());
+                    p = buffer.data();
+                }
+            }
+            *p++ = '\n';
+        }
+        os.write(buffer.data(), p - buffer.data());
+    }
+
+    void save_text(const std::string& path, char delimiter = ',') const {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()){
+            throw std::runtime_error("Error: Can't open " + path + " for writing!");
+        }
+        write_text(file, delimiter);
+        file.close();
+        if (file.fail()){
+            throw std::runtime_error("Error: Failed to write " + path);
+        }
+    }
+
+    // Writes the binary format described at matrix_file_header.
+    void save_binary(const std::string& path) const {
+        matrix_file_header h;
+        h.type_kind = matrix_type_kind<T>();
+        h.element_size = sizeof(T);
+        h.rows = ROWS;
+        h.cols = COLS;
+        h.data_offset = 1u << h.alignment_log2;
+        if (!Layout::row_major){
+            h.version = 2;
+            h.column_major = 1;
+        }
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()){
+            throw std::runtime_error("Error: Can't open " + path + " for writing!");
+        }
+        char padding[64] = {};
+        file.write((const char*)&h, sizeof(h));
+        file.write(padding, h.data_offset - sizeof(h));
+        file.write((const char*)DATA, (std::streamsize)SIZE * sizeof(T));
+        file.close();
+        if (file.fail()){
+            throw std::runtime_error("Error: Failed to write " + path);
+        }
+    }
+
+    // Reads a whole binary matrix file into a new matrix, with one read for
+    // the elements. A file in the other storage order is converted.
+    static Matrix load_binary(const std::string& path){
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file.is_open()){
+            throw std::runtime_error("Error: Can't open " + path);
+        }
+        size_t file_size = file.tellg();
+        file.seekg(0);
+
+        matrix_file_header h;
+        if (!file.read((char*)&h, sizeof(h))){
+            throw std::runtime_error("Error: Truncated matrix file: " + path);
+        }
+        h = check_header(h, file_size, path);
+
+        Matrix M(h.rows, h.cols);
+        file.seekg(h.data_offset);
+        if (!file.read((char*)M.DATA, (std::streamsize)M.SIZE * sizeof(T))){
+            throw std::runtime_error("Error: Truncated matrix file: " + path);
+        }
+        if ((bool)h.column_major == Layout::row_major){
+            Matrix stored(h.rows, h.cols);
+            transpose_elements(M.DATA, stored.DATA, h.column_major ? h.cols : h.rows, h.column_major ? h.rows : h.cols);
+            M = std::move(stored);
+        }
+        return M;
+    }
+
+    static Matrix identity_matrix(unsigned size){
+        Matrix M(size, size);
         for (unsigned i = 0 ; i < size ; i++){
             M.DATA[i * (size + 1)] = 1;
         }
         return M;
     }
 
-    static Matrix<T> zeros_matrix(unsigned rows, unsigned cols){
-        Matrix<T> M(rows, cols);
+    static Matrix zeros_matrix(unsigned rows, unsigned cols){
+        Matrix M(rows, cols);
         return M;
     }
     
-    static Matrix<T> ones_matrix(unsigned rows, unsigned cols){
-        Matrix<T> M(rows, cols, 1);
+    static Matrix ones_matrix(unsigned rows, unsigned cols){
+        Matrix M(rows, cols, 1);
         return M;
     }
 
-    static Matrix<T> filled_matrix(unsigned rows, unsigned cols, T scalar = T()){
-        Matrix<T> M(rows, cols, scalar);
+    static Matrix filled_matrix(unsigned rows, unsigned cols, T scalar = T()){
+        Matrix M(rows, cols, scalar);
         return M;
     }
 
-    static Matrix<T> random_matrix(unsigned rows, unsigned cols, T min = 0, T max = 1){
-        Matrix<T> M(rows, cols);
-        
-        for (unsigned i = 0 ; i < M.SIZE ; i++){
-            M.DATA[i] = generate_random_number(min, max);
-        }
+    // Uniform in [min, max) for floating point T, [min, max] for integers.
+    // Each call uses a new stream, so results differ between calls.
+    static Matrix random_matrix(unsigned rows, unsigned cols, T min = 0, T max = 1){
+        Matrix M(rows, cols);
+        M.fill_random_stream(min, max, random_stream(nullptr), 1);
+        return M;
+    }
 
+    // Reproducible: the same seed gives the same matrix, for any number of
+    // threads.
+    static Matrix random_matrix(unsigned rows, unsigned cols, T min, T max, uint64_t seed, unsigned threads = 1){
+        Matrix M(rows, cols);
+        M.fill_random_stream(min, max, random_stream(&seed), threads);
         return M;
     }
     
@@ -927,9 +1387,11 @@ public:
     }
     
     void fill_random(T min = 0, T max = 1){
-        for (unsigned i = 0 ; i < SIZE ; i++){
-            DATA[i] = generate_random_number(min, max);
-        }
+        fill_random_stream(min, max, random_stream(nullptr), 1);
+    }
+
+    void fill_random(T min, T max, uint64_t seed, unsigned threads = 1){
+        fill_random_stream(min, max, random_stream(&seed), threads);
     }
 
     Matrix submatrix(unsigned start_row, unsigned start_col, unsigned end_row, unsigned end_col) const {
@@ -944,7 +1406,7 @@ public:
             throw std::runtime_error("Error: Invalid index!");
         }
 
-        Matrix<T> M(end_row-start_row, end_col-start_col);
+        Matrix M(end_row-start_row, end_col-start_col);
 
         for (unsigned i = start_row ; i < end_row ; i++){
             for (unsigned j = start_col ; j < end_col ; j++){
@@ -955,9 +1417,25 @@ public:
         return M;
     }
 
+    // Linear algebra for floating point T, through LUDecomposition. With
+    // threads > 1 the large updates of the factorization and the solves
+    // are split between that many threads.
+    T determinant(unsigned threads = 1) const {
+        return LUDecomposition<T>(*this, threads).determinant();
+    }
+
+    Matrix inverse(unsigned threads = 1) const {
+        return LUDecomposition<T>(*this, threads).template inverse<Layout>(threads);
+    }
+
+    // The x with (*this) x = b, for a b with one or more columns.
+    Matrix solve(const Matrix& b, unsigned threads = 1) const {
+        return LUDecomposition<T>(*this, threads).solve(b, threads);
+    }
+
     template <typename Func>
     Matrix apply(Func func) const {
-        Matrix<T> result(ROWS, COLS);
+        Matrix result(ROWS, COLS);
         for (unsigned i = 0 ; i < SIZE ; i++){
             result.DATA[i] = func(DATA[i]);
         }
@@ -970,8 +1448,583 @@ public:
             DATA[i] = func(DATA[i]);
         }
     }
+
+    // Reductions. Loops are over the contiguous elements without early exits
+    // or branches, so the compiler vectorizes them; sum keeps 8 partial sums
+    // so floating point sums vectorize too (in a different order than a
+    // plain loop, so the last bits may differ).
+    T sum() const {
+        static_assert(!std::is_same<T, bool>::value, "Error: Use count() for Matrix<bool>!");
+        T partial[8] = {};
+        unsigned i = 0;
+        for ( ; i + 8 <= SIZE ; i += 8){
+            for (unsigned k = 0 ; k < 8 ; k++){
+                partial[k] += DATA[i + k];
+            }
+        }
+        for ( ; i < SIZE ; i++){
+            partial[0] += DATA[i];
+        }
+        T total = T();
+        for (unsigned k = 0 ; k < 8 ; k++){
+            total += partial[k];
+        }
+        return total;
+    }
+
+    T min() const {
+        if (SIZE == 0){
+            throw std::runtime_error("Error: Empty matrix!");
+        }
+        T result = DATA[0];
+        for (unsigned i = 1 ; i < SIZE ; i++){
+            result = DATA[i] < result ? DATA[i] : result;
+        }
+        return result;
+    }
+
+    T max() const {
+        if (SIZE == 0){
+            throw std::runtime_error("Error: Empty matrix!");
+        }
+        T result = DATA[0];
+        for (unsigned i = 1 ; i < SIZE ; i++){
+            result = DATA[i] > result ? DATA[i] : result;
+        }
+        return result;
+    }
+
+    // Fused compare and count: count_if([](T v){ return v > x; }) counts
+    // what count of (m > x) would, without building the Matrix<bool>.
+    template <typename Pred>
+    size_t count_if(Pred pred) const {
+        size_t n = 0;
+        for (unsigned i = 0 ; i < SIZE ; i++){
+            n += pred(DATA[i]) ? 1 : 0;
+        }
+        return n;
+    }
+
+    // Element by element against another matrix, e.g. count_if(m, std::less<T>()).
+    template <typename Pred>
+    size_t count_if(const Matrix& m, Pred pred) const {
+        if (ROWS != m.ROWS || COLS != m.COLS){
+            throw std::runtime_error("Error: Size mismatch!");
+        }
+        size_t n = 0;
+        for (unsigned i = 0 ; i < SIZE ; i++){
+            n += pred(DATA[i], m.DATA[i]) ? 1 : 0;
+        }
+        return n;
+    }
+
+    // Blocks of 64 elements are counted branch free, stopping between blocks.
+    template <typename Pred>
+    bool any_of(Pred pred) const {
+        for (unsigned start = 0 ; start < SIZE ; start += 64){
+            unsigned end = (SIZE - start < 64) ? SIZE : start + 64;
+            unsigned n = 0;
+            for (unsigned i = start ; i < end ; i++){
+                n += pred(DATA[i]) ? 1 : 0;
+            }
+            if (n) return true;
+        }
+        return false;
+    }
+
+    template <typename Pred>
+    bool all_of(Pred pred) const {
+        return !any_of([&](const T& v){ return !pred(v); });
+    }
+
+    size_t count() const { return count_if([](const T& v){ return v != T(); }); }
+    bool any() const { return any_of([](const T& v){ return v != T(); }); }
+    bool all() const { return all_of([](const T& v){ return v != T(); }); }
+
+    // Per row reductions give a ROWS x 1 matrix, per column ones 1 x COLS.
+    Matrix row_sums() const { return reduce_rows<T>(T(), [](T a, T b){ return a + b; }); }
+    Matrix col_sums() const { return reduce_cols<T>(T(), [](T a, T b){ return a + b; }); }
+    Matrix row_min() const { return reduce_rows_from_first([](T a, T b){ return b < a ? b : a; }); }
+    Matrix col_min() const { return reduce_cols_from_first([](T a, T b){ return b < a ? b : a; }); }
+    Matrix row_max() const { return reduce_rows_from_first([](T a, T b){ return b > a ? b : a; }); }
+    Matrix col_max() const { return reduce_cols_from_first([](T a, T b){ return b > a ? b : a; }); }
+    Matrix<unsigned, Layout> row_counts() const { return reduce_rows<unsigned>(0, [](unsigned n, T v){ return n + (v != T()); }); }
+    Matrix<unsigned, Layout> col_counts() const { return reduce_cols<unsigned>(0, [](unsigned n, T v){ return n + (v != T()); }); }
+    Matrix<bool, Layout> row_all() const { return reduce_rows<bool>(true, [](bool a, T v){ return a & (v != T()); }); }
+    Matrix<bool, Layout> col_all() const { return reduce_cols<bool>(true, [](bool a, T v){ return a & (v != T()); }); }
+    Matrix<bool, Layout> row_any() const { return reduce_rows<bool>(false, [](bool a, T v){ return a | (v != T()); }); }
+    Matrix<bool, Layout> col_any() const { return reduce_cols<bool>(false, [](bool a, T v){ return a | (v != T()); }); }
+
+private:
+    // Storage is lines() contiguous lines of line_length() elements: rows
+    // for RowMajor, columns for ColumnMajor.
+    unsigned lines() const { return Layout::row_major ? ROWS : COLS; }
+    unsigned line_length() const { return Layout::row_major ? COLS : ROWS; }
+
+    // out[c * lines + r] = in[r * length + c], in 32 x 32 tiles so both
+    // sides are read and written a cache line at a time.
+    static void transpose_elements(const T* in, T* out, unsigned lines, unsigned length){
+        const unsigned tile = 32;
+        for (unsigned r0 = 0 ; r0 < lines ; r0 += tile){
+            unsigned r1 = std::min(r0 + tile, lines);
+            for (unsigned c0 = 0 ; c0 < length ; c0 += tile){
+                unsigned c1 = std::min(c0 + tile, length);
+                for (unsigned r = r0 ; r < r1 ; r++){
+                    for (unsigned c = c0 ; c < c1 ; c++){
+                        out[(size_t)c * lines + r] = in[(size_t)r * length + c];
+                    }
+                }
+            }
+        }
+    }
+
+    // M = (*this) m, for a zeroed M. The loop order keeps the innermost loop
+    // on contiguous elements: rows of m and M for RowMajor, columns of
+    // *this and M for ColumnMajor. Each element still sums its products in
+    // order of k.
+    void multiply_into(const Matrix& m, Matrix& M) const {
+        if constexpr (Layout::row_major) {
+            for (unsigned i = 0 ; i < ROWS ; i++){
+                T* out = M.DATA + (size_t)i * m.COLS;
+                for (unsigned k = 0 ; k < COLS ; k++){
+                    T a = DATA[(size_t)i * COLS + k];
+                    const T* row = m.DATA + (size_t)k * m.COLS;
+                    for (unsigned j = 0 ; j < m.COLS ; j++){
+                        out[j] += a * row[j];
+                    }
+                }
+            }
+        } else {
+            for (unsigned j = 0 ; j < m.COLS ; j++){
+                T* out = M.DATA + (size_t)j * ROWS;
+                for (unsigned k = 0 ; k < COLS ; k++){
+                    T b = m.DATA[(size_t)j * m.ROWS + k];
+                    const T* col = DATA + (size_t)k * ROWS;
+                    for (unsigned i = 0 ; i < ROWS ; i++){
+                        out[i] += b * col[i];
+                    }
+                }
+            }
+        }
+    }
+
+    // Row results are per line for RowMajor and across lines for
+    // ColumnMajor, column results the other way round. ROWS x 1 and 1 x COLS
+    // matrices are stored alike in either order.
+    template <typename R, typename Op>
+    Matrix<R, Layout> reduce_rows(R init, Op op) const {
+        Matrix<R, Layout> M(ROWS, 1);
+        if constexpr (Layout::row_major) reduce_lines(M.DATA, init, op);
+        else reduce_across(M.DATA, init, op);
+        return M;
+    }
+
+    template <typename R, typename Op>
+    Matrix<R, Layout> reduce_cols(R init, Op op) const {
+        Matrix<R, Layout> M(1, COLS);
+        if constexpr (Layout::row_major) reduce_across(M.DATA, init, op);
+        else reduce_lines(M.DATA, init, op);
+        return M;
+    }
+
+    template <typename Op>
+    Matrix reduce_rows_from_first(Op op) const {
+        Matrix M(ROWS, 1);
+        if constexpr (Layout::row_major) reduce_lines_from_first(M.DATA, op);
+        else reduce_across_from_first(M.DATA, op);
+        return M;
+    }
+
+    template <typename Op>
+    Matrix reduce_cols_from_first(Op op) const {
+        Matrix M(1, COLS);
+        if constexpr (Layout::row_major) reduce_across_from_first(M.DATA, op);
+        else reduce_lines_from_first(M.DATA, op);
+        return M;
+    }
+
+    // One result per line, each walking its contiguous line.
+    template <typename R, typename Op>
+    void reduce_lines(R* out, R init, Op op) const {
+        unsigned n = line_length();
+        for (unsigned l = 0 ; l < lines() ; l++){
+            R acc = init;
+            const T* line = DATA + (size_t)l * n;
+            for (unsigned k = 0 ; k < n ; k++){
+                acc = op(acc, line[k]);
+            }
+            out[l] = acc;
+        }
+    }
+
+    // One result per position in a line: walks the lines in memory order,
+    // updating one accumulator per position.
+    template <typename R, typename Op>
+    void reduce_across(R* out, R init, Op op) const {
+        unsigned n = line_length();
+        for (unsigned k = 0 ; k < n ; k++){
+            out[k] = init;
+        }
+        for (unsigned l = 0 ; l < lines() ; l++){
+            const T* line = DATA + (size_t)l * n;
+            for (unsigned k = 0 ; k < n ; k++){
+                out[k] = op(out[k], line[k]);
+            }
+        }
+    }
+
+    template <typename Op>
+    void reduce_lines_from_first(T* out, Op op) const {
+        unsigned n = line_length();
+        for (unsigned l = 0 ; l < lines() ; l++){
+            const T* line = DATA + (size_t)l * n;
+            T acc = line[0];
+            for (unsigned k = 1 ; k < n ; k++){
+                acc = op(acc, line[k]);
+            }
+            out[l] = acc;
+        }
+    }
+
+    template <typename Op>
+    void reduce_across_from_first(T* out, Op op) const {
+        unsigned n = line_length();
+        for (unsigned k = 0 ; k < n ; k++){
+            out[k] = DATA[k];
+        }
+        for (unsigned l = 1 ; l < lines() ; l++){
+            const T* line = DATA + (size_t)l * n;
+            for (unsigned k = 0 ; k < n ; k++){
+                out[k] = op(out[k], line[k]);
+            }
+        }
+    }
 };
 
+// A binary matrix file mapped read-only, used in place: opening costs the
+// same for any size, and pages are read from disk as they are touched.
+// matrix() is a const Matrix over the mapping, valid while this object
+// lives; copying it gives an ordinary, writable Matrix. The file must be in
+// the storage order of Layout.
+template <typename T, typename Layout>
+class MappedMatrix{
+private:
+    void* MAPPING = nullptr;
+    size_t LENGTH = 0;
+    Matrix<T, Layout> VIEW{1, 1};
+
+public:
+    explicit MappedMatrix(const std::string& path){
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0){
+            throw std::runtime_error("Error: Can't open " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(matrix_file_header)){
+            close(fd);
+            throw std::runtime_error("Error: Truncated matrix file: " + path);
+        }
+
+        LENGTH = st.st_size;
+        MAPPING = mmap(nullptr, LENGTH, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (MAPPING == MAP_FAILED){
+            MAPPING = nullptr;
+            throw std::runtime_error("Error: Can't map " + path);
+        }
+
+        try {
+            matrix_file_header h = Matrix<T, Layout>::check_header(*(const matrix_file_header*)MAPPING, LENGTH, path);
+            if ((bool)h.column_major == Layout::row_major){
+                throw std::runtime_error("Error: Matrix file is in the other storage order: " + path);
+            }
+            VIEW = Matrix<T, Layout>(typename Matrix<T, Layout>::view_tag(), h.rows, h.cols, (T*)((char*)MAPPING + h.data_offset));
+        } catch (...) {
+            munmap(MAPPING, LENGTH);
+            throw;
+        }
+    }
+
+    MappedMatrix(const MappedMatrix&) = delete;
+    MappedMatrix& operator=(const MappedMatrix&) = delete;
+
+    MappedMatrix(MappedMatrix&& other) noexcept : MAPPING(other.MAPPING), LENGTH(other.LENGTH), VIEW(std::move(other.VIEW)) {
+        other.MAPPING = nullptr;
+        other.LENGTH = 0;
+    }
+
+    ~MappedMatrix(){
+        if (MAPPING) munmap(MAPPING, LENGTH);
+    }
+
+    const Matrix<T, Layout>& matrix() const { return VIEW; }
+    operator const Matrix<T, Layout>&() const { return VIEW; }
+};
+
+// LU decomposition with partial pivoting: P A = L U, with L (unit diagonal,
+// not stored) below the diagonal of factors() and U on and above it.
+//
+// The factorization is blocked: a panel of BLOCK columns is factored, the
+// rows of U to its right are solved, and then the trailing matrix gets one
+// rank-BLOCK update. That update holds nearly all the work; it runs over
+// tiles of columns, so the rows of U it reads stay in cache, and its rows
+// are split between threads when it is large enough to pay for them.
+template <typename T>
+class LUDecomposition{
+private:
+    static const unsigned BLOCK = 64;
+    static const unsigned TILE = 256;
+
+    Matrix<T> LU;
+    std::vector<unsigned> PERMUTATION;      // row i of P A is row PERMUTATION[i] of A
+    int SIGN = 1;
+    bool SINGULAR = false;
+
+    // Calls func(first, last) on parts of rows [first, last), in parallel if
+    // there are threads and work enough (work is the operations per row).
+    template <typename Func>
+    static void for_rows(unsigned first, unsigned last, size_t work, unsigned threads, Func func){
+        unsigned rows = last - first;
+        if (threads > rows) threads = rows;
+        if (threads <= 1 || rows * work < (1u << 20)){
+            func(first, last);
+            return;
+        }
+
+        std::vector<std::thread> workers;
+        for (unsigned t = 0 ; t < threads ; t++){
+            workers.emplace_back(func, first + (unsigned long long)rows * t / threads, first + (unsigned long long)rows * (t + 1) / threads);
+        }
+        for (std::thread& w : workers) w.join();
+    }
+
+    // Unblocked factorization of columns [k0, k1), swapping whole rows.
+    void factor_panel(unsigned k0, unsigned k1){
+        unsigned n = LU.get_rows();
+        T* a = LU.data();
+        for (unsigned j = k0 ; j < k1 ; j++){
+            unsigned pivot = j;
+            T largest = std::abs(a[(size_t)j * n + j]);
+            for (unsigned i = j + 1 ; i < n ; i++){
+                T v = std::abs(a[(size_t)i * n + j]);
+                if (v > largest){
+                    largest = v;
+                    pivot = i;
+                }
+            }
+            if (largest == T()){
+                SINGULAR = true;
+                continue;
+            }
+            if (pivot != j){
+                std::swap_ranges(a + (size_t)j * n, a + (size_t)(j + 1) * n, a + (size_t)pivot * n);
+                std::swap(PERMUTATION[j], PERMUTATION[pivot]);
+                SIGN = -SIGN;
+            }
+
+            const T* u = a + (size_t)j * n;
+            T inverse_pivot = T(1) / u[j];
+            for (unsigned i = j + 1 ; i < n ; i++){
+                T* row = a + (size_t)i * n;
+                T l = row[j] *= inverse_pivot;
+                for (unsigned c = j + 1 ; c < k1 ; c++){
+                    row[c] -= l * u[c];
+                }
+            }
+        }
+    }
+
+    void factor(unsigned threads){
+        unsigned n = LU.get_rows();
+        T* a = LU.data();
+        for (unsigned k0 = 0 ; k0 < n ; k0 += BLOCK){
+            unsigned k1 = std::min(k0 + BLOCK, n);
+            factor_panel(k0, k1);
+            if (k1 == n) break;
+
+            // U12 = inverse(L11) A12, row by row.
+            for (unsigned i = k0 + 1 ; i < k1 ; i++){
+                T* row = a + (size_t)i * n;
+                for (unsigned p = k0 ; p < i ; p++){
+                    const T* u = a + (size_t)p * n;
+                    T l = row[p];
+                    for (unsigned c = k1 ; c < n ; c++){
+                        row[c] -= l * u[c];
+                    }
+                }
+            }
+
+            // A22 -= L21 U12
+            for_rows(k1, n, (size_t)(n - k1) * (k1 - k0), threads, [=](unsigned first, unsigned last){
+                for (unsigned c0 = k1 ; c0 < n ; c0 += TILE){
+                    unsigned c1 = std::min(c0 + TILE, n);
+                    for (unsigned i = first ; i < last ; i++){
+                        T* row = a + (size_t)i * n;
+                        unsigned p = k0;
+                        // Four rows of U per pass, so each element of the row is
+                        // loaded and stored a quarter as often.
+                        for ( ; p + 4 <= k1 ; p += 4){
+                            const T* u0 = a + (size_t)p * n;
+                            const T* u1 = u0 + n;
+                            const T* u2 = u1 + n;
+                            const T* u3 = u2 + n;
+                            T l0 = row[p], l1 = row[p + 1], l2 = row[p + 2], l3 = row[p + 3];
+                            for (unsigned c = c0 ; c < c1 ; c++){
+                                row[c] -= l0 * u0[c] + l1 * u1[c] + l2 * u2[c] + l3 * u3[c];
+                            }
+                        }
+                        for ( ; p < k1 ; p++){
+                            const T* u = a + (size_t)p * n;
+                            T l = row[p];
+                            for (unsigned c = c0 ; c < c1 ; c++){
+                                row[c] -= l * u[c];
+                            }
+                        }
+                    }
+                }
+            });
+        }
+    }
+
+public:
+    // Factors a copy of m, in row major order whatever the order of m.
+    template <typename Layout>
+    explicit LUDecomposition(const Matrix<T, Layout>& m, unsigned threads = 1) : LU(m.template to_layout<RowMajor>()) {
+        static_assert(std::is_floating_point<T>::value, "Error: LU decomposition needs a floating point type!");
+        if (m.get_rows() != m.get_cols()){
+            throw std::runtime_error("Error: Matrix is not square!");
+        }
+        PERMUTATION.resize(m.get_rows());
+        for (unsigned i = 0 ; i < m.get_rows() ; i++){
+            PERMUTATION[i] = i;
+        }
+        factor(threads);
+    }
+
+    // True if a pivot was exactly zero; determinant() is then 0 and solving
+    // throws.
+    bool singular() const { return SINGULAR; }
+
+    const Matrix<T>& factors() const { return LU; }
+    const std::vector<unsigned>& permutation() const { return PERMUTATION; }
+
+    T determinant() const {
+        if (SINGULAR) return T();
+        unsigned n = LU.get_rows();
+        const T* a = LU.data();
+        T det = SIGN;
+        for (unsigned i = 0 ; i < n ; i++){
+            det *= a[(size_t)i * n + i];
+        }
+        return det;
+    }
+
+    // Forward and back substitution, a row of b at a time, so the inner
+    // loops run along the rows. The columns of b are done in slabs of TILE
+    // and the rows in blocks of BLOCK, so a solved block of a slab stays in
+    // cache while it is folded into the rest, four rows per pass like the
+    // trailing update of factor(). Slabs are split between threads.
+    Matrix<T> solve(const Matrix<T>& b, unsigned threads = 1) const {
+        unsigned n = LU.get_rows(), k = b.get_cols();
+        if (b.get_rows() != n){
+            throw std::runtime_error("Error: Can't solve, size mismatch!");
+        }
+        if (SINGULAR){
+            throw std::runtime_error("Error: Matrix is singular!");
+        }
+
+        Matrix<T> X(n, k);
+        const T* a = LU.data();
+        const T* in = b.data();
+        T* x = X.data();
+        for (unsigned i = 0 ; i < n ; i++){
+            std::copy(in + (size_t)PERMUTATION[i] * k, in + (size_t)(PERMUTATION[i] + 1) * k, x + (size_t)i * k);
+        }
+
+        // row[c0, c1) -= sum of factors[p] * x[p][c0, c1) for p in [p0, p1).
+        auto fold = [=](T* row, const T* factors, unsigned p0, unsigned p1, unsigned c0, unsigned c1){
+            unsigned p = p0;
+            for ( ; p + 4 <= p1 ; p += 4){
+                const T* x0 = x + (size_t)p * k;
+                const T* x1 = x0 + k;
+                const T* x2 = x1 + k;
+                const T* x3 = x2 + k;
+                T f0 = factors[p], f1 = factors[p + 1], f2 = factors[p + 2], f3 = factors[p + 3];
+                for (unsigned c = c0 ; c < c1 ; c++){
+                    row[c] -= f0 * x0[c] + f1 * x1[c] + f2 * x2[c] + f3 * x3[c];
+                }
+            }
+            for ( ; p < p1 ; p++){
+                const T* other = x + (size_t)p * k;
+                T f = factors[p];
+                for (unsigned c = c0 ; c < c1 ; c++){
+                    row[c] -= f * other[c];
+                }
+            }
+        };
+
+        unsigned slabs = (k + TILE - 1) / TILE;
+        if (threads > slabs) threads = slabs;
+        auto substitute = [=](unsigned first, unsigned last){
+            for (unsigned s = first ; s < last ; s++){
+                unsigned c0 = s * TILE, c1 = std::min(c0 + TILE, k);
+
+                // L y = P b: solve a block of BLOCK rows, then fold it into
+                // every row below while it is still in cache.
+                for (unsigned k0 = 0 ; k0 < n ; k0 += BLOCK){
+                    unsigned k1 = std::min(k0 + BLOCK, n);
+                    for (unsigned i = k0 + 1 ; i < k1 ; i++){
+                        fold(x + (size_t)i * k, a + (size_t)i * n, k0, i, c0, c1);
+                    }
+                    for (unsigned i = k1 ; i < n ; i++){
+                        fold(x + (size_t)i * k, a + (size_t)i * n, k0, k1, c0, c1);
+                    }
+                }
+
+                // U x = y, the same from the last block up.
+                for (unsigned k1 = n ; k1 > 0 ; ){
+                    unsigned k0 = k1 > BLOCK ? k1 - BLOCK : 0;
+                    for (unsigned i = k1 ; i-- > k0 ; ){
+                        T* row = x + (size_t)i * k;
+                        fold(row, a + (size_t)i * n, i + 1, k1, c0, c1);
+                        T inverse_pivot = T(1) / a[(size_t)i * n + i];
+                        for (unsigned c = c0 ; c < c1 ; c++){
+                            row[c] *= inverse_pivot;
+                        }
+                    }
+                    for (unsigned i = 0 ; i < k0 ; i++){
+                        fold(x + (size_t)i * k, a + (size_t)i * n, k0, k1, c0, c1);
+                    }
+                    k1 = k0;
+                }
+            }
+        };
+
+        if (threads <= 1 || (size_t)n * n * k < (1u << 20)){
+            substitute(0, slabs);
+        }
+        else{
+            std::vector<std::thread> workers;
+            for (unsigned t = 0 ; t < threads ; t++){
+                workers.emplace_back(substitute, slabs * t / threads, slabs * (t + 1) / threads);
+            }
+            for (std::thread& w : workers) w.join();
+        }
+        return X;
+    }
+
+    // Column major right hand sides are solved in row major order.
+    Matrix<T, ColumnMajor> solve(const Matrix<T, ColumnMajor>& b, unsigned threads = 1) const {
+        return solve(b.template to_layout<RowMajor>(), threads).template to_layout<ColumnMajor>();
+    }
+
+    template <typename Layout = RowMajor>
+    Matrix<T, Layout> inverse(unsigned threads = 1) const {
+        return solve(Matrix<T, Layout>::identity_matrix(LU.get_rows()), threads);
+    }
+};
+
+
 // int main(){
 //     int a[] = {2, 0, 0, 0, 2, 0, 0, 0, 2};
 //     int b[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
@@ -0,0 +1,348 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include "Matrix.cpp"
+#include "SparseMatrix.cpp"
+#include "BatchMatrix.cpp"
+
+
+// Checks of the Matrix library against plain loops over get(): storage
+// orders, binary and text files, reductions, the LU solvers, the random
+// fills, SparseMatrix and BatchMatrix. Run by the hidden `matrix-selftest`
+// command; every check prints one line, and the result is the number that
+// failed.
+class matrix_self_test{
+private:
+    std::ostream& out;
+    std::string directory;
+    unsigned failures = 0;
+    unsigned checks = 0;
+
+    void check(const std::string& name, bool passed){
+        checks++;
+        if (!passed) failures++;
+        out << (passed ? "ok     " : "FAILED ") << name << "\n";
+    }
+
+    // Runs body and reports whether it threw a runtime_error whose message
+    // contains expected.
+    template <typename Body>
+    void check_throws(const std::string& name, const std::string& expected, Body body){
+        std::string message;
+        try {
+            body();
+        } catch (const std::runtime_error& e) {
+            message = e.what();
+        }
+        check(name, !message.empty() && message.find(expected) != std::string::npos);
+    }
+
+    std::string temp_path(const std::string& name) const {
+        return directory + "/matrix-selftest-" + std::to_string(getpid()) + "-" + name;
+    }
+
+    template <typename T, typename L1, typename L2>
+    static bool same(const Matrix<T, L1>& a, const Matrix<T, L2>& b){
+        if (a.get_rows() != b.get_rows() || a.get_cols() != b.get_cols()) return false;
+        for (unsigned i = 0 ; i < a.get_rows() ; i++){
+            for (unsigned j = 0 ; j < a.get_cols() ; j++){
+                if (a.get(i, j) != b.get(i, j)) return false;
+            }
+        }
+        return true;
+    }
+
+    template <typename T, typename L1, typename L2>
+    static T largest_difference(const Matrix<T, L1>& a, const Matrix<T, L2>& b){
+        T largest = 0;
+        for (unsigned i = 0 ; i < a.get_rows() ; i++){
+            for (unsigned j = 0 ; j < a.get_cols() ; j++){
+                largest = std::max(largest, std::abs(a.get(i, j) - b.get(i, j)));
+            }
+        }
+        return largest;
+    }
+
+    template <typename T, typename Layout>
+    static Matrix<T, Layout> naive_product(const Matrix<T, Layout>& a, const Matrix<T, Layout>& b){
+        Matrix<T, Layout> M(a.get_rows(), b.get_cols());
+        for (unsigned i = 0 ; i < a.get_rows() ; i++){
+            for (unsigned j = 0 ; j < b.get_cols() ; j++){
+                T sum = 0;
+                for (unsigned k = 0 ; k < a.get_cols() ; k++){
+                    sum += a.get(i, k) * b.get(k, j);
+                }
+                M.set(i, j, sum);
+            }
+        }
+        return M;
+    }
+
+    template <typename Layout>
+    void test_layout(const std::string& name){
+        Matrix<double> a = Matrix<double>::random_matrix(37, 45, -1.0, 1.0, 1);
+        Matrix<double, Layout> b = a.template to_layout<Layout>();
+        check(name + ": to_layout keeps every element", same(a, b));
+        check(name + ": to_layout back is exact", same(a, b.template to_layout<RowMajor>()));
+        check(name + ": transpose", same(b.return_transpose(), a.return_transpose()));
+
+        Matrix<double, Layout> c = Matrix<double>::random_matrix(45, 29, -1.0, 1.0, 2).template to_layout<Layout>();
+        check(name + ": operator* matches the plain product", largest_difference(b * c, naive_product(b, c)) < 1e-12);
+    }
+
+    template <typename Layout>
+    void test_binary(const std::string& name){
+        Matrix<int, Layout> a = Matrix<int>::random_matrix(19, 23, -1000, 1000, 3).template to_layout<Layout>();
+        std::string path = temp_path(name + ".bin");
+        a.save_binary(path);
+        check(name + ": binary round trip", same(a, Matrix<int, Layout>::load_binary(path)));
+        check(name + ": binary read into the other order", same(a, Matrix<int, RowMajor>::load_binary(path)) && same(a, Matrix<int, ColumnMajor>::load_binary(path)));
+        {
+            MappedMatrix<int, Layout> mapped(path);
+            check(name + ": mapped view", same(a, mapped.matrix()));
+        }
+        check_throws(name + ": element type is checked", "another element type", [&](){ Matrix<float, Layout>::load_binary(path); });
+
+        // A header claiming 2^32 - 1 rows must be refused before any read.
+        {
+            std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+            uint32_t rows = 0xFFFFFFFFu;
+            file.seekp(offsetof(matrix_file_header, rows));
+            file.write((const char*)&rows, sizeof(rows));
+        }
+        check_throws(name + ": oversized header is refused", "matrix", [&](){ Matrix<int, Layout>::load_binary(path); });
+        std::remove(path.c_str());
+    }
+
+    template <typename Layout>
+    void test_text(const std::string& name){
+        Matrix<double, Layout> a = Matrix<double>::random_matrix(11, 7, -1e6, 1e6, 4).template to_layout<Layout>();
+        std::stringstream ss;
+        a.write_text(ss, ',');
+        std::string text = ss.str();
+        check(name + ": text round trip is exact", same(a, Matrix<double, Layout>::parse_text(text.data(), text.size(), ',', 3)));
+
+        std::string blanks = "1 2\t 3\n\n4  5 6\n";
+        Matrix<int, Layout> b = Matrix<int, Layout>::parse_text(blanks.data(), blanks.size(), ' ');
+        check(name + ": blank separated text", b.get_rows() == 2 && b.get_cols() == 3 && b.get(1, 2) == 6 && b.get(0, 1) == 2);
+
+        std::string bad = "1,2,3\n4,x,6\n";
+        check_throws(name + ": parse errors name the line and column", "line 2, column 3", [&](){
+            Matrix<int, Layout>::parse_text(bad.data(), bad.size(), ',');
+        });
+        std::string short_row = "1,2,3\n4,5\n";
+        check_throws(name + ": short rows are refused", "line 2", [&](){
+            Matrix<int, Layout>::parse_text(short_row.data(), short_row.size(), ',');
+        });
+    }
+
+    template <typename Layout>
+    void test_reductions(const std::string& name){
+        Matrix<int, Layout> a = Matrix<int>::random_matrix(21, 34, -50, 50, 5).template to_layout<Layout>();
+        long long sum = 0;
+        int low = a.get(0, 0), high = a.get(0, 0);
+        size_t positive = 0, nonzero = 0;
+        Matrix<int, Layout> rows(a.get_rows(), 1, 0), cols(1, a.get_cols(), 0);
+        for (unsigned i = 0 ; i < a.get_rows() ; i++){
+            for (unsigned j = 0 ; j < a.get_cols() ; j++){
+                int v = a.get(i, j);
+                sum += v;
+                low = std::min(low, v);
+                high = std::max(high, v);
+                positive += v > 0;
+                nonzero += v != 0;
+                rows.set(i, 0, rows.get(i, 0) + v);
+                cols.set(0, j, cols.get(0, j) + v);
+            }
+        }
+        check(name + ": sum, min and max", a.sum() == sum && a.min() == low && a.max() == high);
+        check(name + ": count_if and count", a.count_if([](int v){ return v > 0; }) == positive && a.count() == nonzero);
+        check(name + ": row and column sums", same(a.row_sums(), rows) && same(a.col_sums(), cols));
+        check(name + ": any and all", a.any() && !Matrix<int, Layout>(3, 4, 0).any() && Matrix<int, Layout>(3, 4, 2).all());
+    }
+
+    template <typename Layout>
+    void test_linear_algebra(const std::string& name){
+        const unsigned n = 150;
+        Matrix<double, Layout> a = Matrix<double>::random_matrix(n, n, -1.0, 1.0, 6).template to_layout<Layout>();
+        Matrix<double, Layout> b = Matrix<double>::random_matrix(n, 3, -1.0, 1.0, 7).template to_layout<Layout>();
+
+        Matrix<double, Layout> x = a.solve(b, 2);
+        check(name + ": solve residual", largest_difference(naive_product(a, x), b) < 1e-9);
+        check(name + ": inverse", largest_difference(naive_product(a, a.inverse()), Matrix<double, Layout>::identity_matrix(n)) < 1e-9);
+
+        Matrix<double, Layout> c = Matrix<double>::random_matrix(4, n, -1.0, 1.0, 8).template to_layout<Layout>();
+        check(name + ": right division", largest_difference(naive_product(c / a, a), c) < 1e-9);
+
+        Matrix<double, Layout> d(3, 3, 0);
+        d.set(0, 1, 2); d.set(1, 0, 3); d.set(2, 2, 4);
+        check(name + ": determinant with a row swap", std::abs(d.determinant() + 24) < 1e-12);
+
+        Matrix<double, Layout> singular(3, 3, 1);
+        check_throws(name + ": singular matrices are refused", "singular", [&](){ singular.solve(b.submatrix(0, 0, 3, 3)); });
+    }
+
+    // A dense matrix with about one element in eight non-zero.
+    static Matrix<double> sparse_pattern(unsigned rows, unsigned cols, uint64_t seed){
+        Matrix<double> values = Matrix<double>::random_matrix(rows, cols, -4.0, 4.0, seed);
+        Matrix<int> keep = Matrix<int>::random_matrix(rows, cols, 0, 7, seed + 1);
+        for (unsigned i = 0 ; i < rows ; i++){
+            for (unsigned j = 0 ; j < cols ; j++){
+                if (keep.get(i, j) != 0) values.set(i, j, 0);
+            }
+        }
+        return values;
+    }
+
+    void test_sparse(){
+        Matrix<double> a = sparse_pattern(60, 45, 20);
+        Matrix<double> b = sparse_pattern(45, 38, 22);
+        SparseMatrix<double> s = SparseMatrix<double>::from_dense(a);
+        SparseMatrix<double> t = SparseMatrix<double>::from_dense(b);
+
+        check("sparse: dense round trip", same(s.to_dense(), a) && s.non_zeros() == a.count());
+        check("sparse: get", s.get(3, 4) == a.get(3, 4) && s.get(59, 44) == a.get(59, 44));
+        check("sparse: transpose", same(s.transpose().to_dense(), a.return_transpose()));
+
+        std::vector<double> x(45), y(60, 0);
+        for (unsigned j = 0 ; j < 45 ; j++) x[j] = j * 0.25 - 3;
+        for (unsigned i = 0 ; i < 60 ; i++){
+            for (unsigned j = 0 ; j < 45 ; j++) y[i] += a.get(i, j) * x[j];
+        }
+        std::vector<double> sx = s.multiply(x, 3);
+        double vector_error = 0;
+        for (unsigned i = 0 ; i < 60 ; i++) vector_error = std::max(vector_error, std::abs(sx[i] - y[i]));
+        check("sparse: times a vector", vector_error < 1e-12);
+
+        Matrix<double> product = naive_product(a, b);
+        check("sparse: times a dense matrix", largest_difference(s.multiply(b, 3), product) < 1e-12);
+        check("sparse: times a column major matrix", largest_difference(s * b.to_layout<ColumnMajor>(), product) < 1e-12);
+        check("sparse: from a column major matrix", same(SparseMatrix<double>::from_dense(a.to_layout<ColumnMajor>()).to_dense(), a));
+        check("sparse: times a sparse matrix", largest_difference((s * t).to_dense(), product) < 1e-12);
+
+        Matrix<double> c = sparse_pattern(60, 45, 24);
+        SparseMatrix<double> u = SparseMatrix<double>::from_dense(c);
+        Matrix<double> sum(60, 45), difference(60, 45), elementwise(60, 45);
+        for (unsigned i = 0 ; i < 60 ; i++){
+            for (unsigned j = 0 ; j < 45 ; j++){
+                sum.set(i, j, a.get(i, j) + c.get(i, j));
+                difference.set(i, j, a.get(i, j) - c.get(i, j));
+                elementwise.set(i, j, a.get(i, j) * c.get(i, j));
+            }
+        }
+        check("sparse: sum, difference and element wise product", same((s + u).to_dense(), sum) && same((s - u).to_dense(), difference)
+              && same(s.hadamard(u).to_dense(), elementwise) && (s - s).non_zeros() == 0);
+
+        SparseMatrix<int> triplets = SparseMatrix<int>::from_triplets(3, 4, {{2, 1, 5}, {0, 3, 1}, {2, 1, -2}, {1, 0, 4}, {1, 0, -4}});
+        check("sparse: triplets are added and zeros dropped", triplets.non_zeros() == 2 && triplets.get(2, 1) == 3 && triplets.get(0, 3) == 1
+              && triplets.get(1, 0) == 0);
+    }
+
+    // 300 matrices fill two chunks and part of a third, so the padding is
+    // exercised too.
+    void test_batch(){
+        const size_t count = 300;
+        BatchMatrix<double, 3, 4> a(count);
+        BatchMatrix<double, 4, 2> b(count);
+        for (size_t k = 0 ; k < count ; k++){
+            a.set(k, Matrix<double>::random_matrix(3, 4, -2.0, 2.0, 30 + k));
+            b.set(k, Matrix<double>::random_matrix(4, 2, -2.0, 2.0, 5000 + k));
+        }
+        Matrix<double> m = Matrix<double>::random_matrix(4, 4, -2.0, 2.0, 29);
+
+        BatchMatrix<double, 3, 2> ab = a * b;
+        BatchMatrix<double, 3, 4> am = a * m;
+        double batch_error = 0, matrix_error = 0;
+        for (size_t k = 0 ; k < count ; k++){
+            batch_error = std::max(batch_error, largest_difference(ab.get(k), a.get(k) * b.get(k)));
+            matrix_error = std::max(matrix_error, largest_difference(am.get(k), a.get(k) * m));
+        }
+        check("batch: times a batch matches operator*", batch_error < 1e-12);
+        check("batch: times a matrix matches operator*", matrix_error < 1e-12);
+        check("batch: transpose", same(a.transpose().get(count - 1), a.get(count - 1).return_transpose()));
+
+        BatchMatrix<double, 3, 4> sum = a + a;
+        sum -= a;
+        sum += a;
+        check("batch: sum and difference", largest_difference(sum.get(7), a.get(7) * 2.0) < 1e-12);
+
+        auto padding_is_zero = [&](const BatchMatrix<double, 3, 4>& batch){
+            for (unsigned i = 0 ; i < 3 ; i++){
+                for (unsigned j = 0 ; j < 4 ; j++){
+                    for (size_t k = count ; k < 384 ; k++){
+                        if (batch(k, i, j) != 0) return false;
+                    }
+                }
+            }
+            return true;
+        };
+        const BatchMatrix<double, 3, 4>& source = a;
+        BatchMatrix<double, 3, 4> inverses = source.apply([](double x){ return 1 / x; });
+        bool copy_padding = padding_is_zero(inverses);
+        inverses.apply([](double x){ return 1 / x + 1; });
+        check("batch: apply leaves the padding alone", copy_padding && padding_is_zero(inverses)
+              && std::abs(inverses(count - 1, 2, 3) - a(count - 1, 2, 3) - 1) < 1e-12);
+    }
+
+    void test_random(){
+        Matrix<double> one = Matrix<double>::random_matrix(300, 300, -2.0, 3.0, 9, 1);
+        Matrix<double> four = Matrix<double>::random_matrix(300, 300, -2.0, 3.0, 9, 4);
+        check("random: a seed gives the same matrix on any number of threads", same(one, four));
+        check("random: doubles lie in [min, max)", one.min() >= -2.0 && one.max() < 3.0);
+        check("random: seeds differ", !same(one, Matrix<double>::random_matrix(300, 300, -2.0, 3.0, 10, 1)));
+
+        Matrix<int> dice = Matrix<int>::random_matrix(100, 100, 1, 6, 11);
+        bool faces = true;
+        for (int f = 1 ; f <= 6 ; f++){
+            size_t n = dice.count_if([f](int v){ return v == f; });
+            faces = faces && n > 1500 && n < 1850;
+        }
+        check("random: integers cover [min, max] evenly", faces && dice.min() == 1 && dice.max() == 6);
+
+        Matrix<uint64_t> wide = Matrix<uint64_t>::random_matrix(64, 64, 0, UINT64_MAX, 12);
+        check("random: the full 64 bit range", wide.max() > UINT64_MAX / 4 * 3 && wide.min() < UINT64_MAX / 4);
+    }
+
+public:
+    explicit matrix_self_test(std::ostream& os) : out(os) {
+        std::error_code ec;
+        directory = std::filesystem::temp_directory_path(ec).string();
+        if (ec || directory.empty()) directory = ".";
+    }
+
+    // Returns the number of failed checks.
+    unsigned run(){
+        // The view constructor once made these ambiguous.
+        Matrix<double> filled(2, 2, 0);
+        Matrix<long> filled_long(2, 2, 0);
+        check("constructor: Matrix(rows, cols, 0)", filled.get(1, 1) == 0 && filled_long.get(0, 1) == 0);
+
+        test_layout<RowMajor>("row major");
+        test_layout<ColumnMajor>("column major");
+        test_binary<RowMajor>("row major");
+        test_binary<ColumnMajor>("column major");
+        test_text<RowMajor>("row major");
+        test_text<ColumnMajor>("column major");
+        test_reductions<RowMajor>("row major");
+        test_reductions<ColumnMajor>("column major");
+        test_linear_algebra<RowMajor>("row major");
+        test_linear_algebra<ColumnMajor>("column major");
+        test_random();
+        test_sparse();
+        test_batch();
+
+        out << checks - failures << " of " << checks << " checks passed" << std::endl;
+        return failures;
+    }
+};
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "Engine.cpp"
+#include "Features.cpp"
+#include "ThreadPool.cpp"
+#include "Catalog.cpp"
+#include "Danger.cpp"
+
+
+struct placement{
+    uint8_t slot = 0;
+    uint8_t row = 0;
+    uint8_t col = 0;
+};
+
+inline unsigned nth_set_bit(uint64_t x, unsigned n){
+    while (n--) x &= x - 1;
+    return __builtin_ctzll(x);
+}
+
+// Uniformly random anchor of a random piece that fits, as a rollout policy.
+inline bool random_placement(uint64_t board, const game_hand& hand, const std::vector<piece_mask>& catalog, game_rng& rng, placement& out){
+    unsigned start = rng.below(hand.count);
+    for (unsigned k = 0 ; k < hand.count ; k++){
+        unsigned slot = (start + k) % hand.count;
+        uint64_t anchors = piece_placements(board, catalog[hand.pieces[slot]]);
+        if (anchors){
+            unsigned anchor = nth_set_bit(anchors, rng.below(__builtin_popcountll(anchors)));
+            out.slot = slot;
+            out.row = anchor / BOARD_SIZE;
+            out.col = anchor % BOARD_SIZE;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Tries every placement of the current hand and plays each one out `rollouts`
+// times with random hands and random moves, keeping the placement with the
+// best mean score gain. Rollouts are spread over the pool; each worker plays
+// them on its own scratch state, so nothing is allocated per step. With an
+// evaluator, a rollout that survives its horizon also counts the evaluation
+// of the board it ends on.
+class monte_carlo_player{
+private:
+    struct alignas(64) scratch{
+        engine_state state;
+        game_hand hand;
+    };
+
+    const piece_catalog& pieces;
+    const std::vector<piece_mask>& catalog;
+    thread_pool& pool;
+    std::vector<scratch> scratches;
+    std::vector<placement> candidates;
+    std::vector<float> outcomes;
+
+public:
+    unsigned rollouts = 64;             // rollouts per candidate placement
+    unsigned horizon = 2;               // hands drawn after the current one
+    float game_over_penalty = 500;
+    const linear_evaluator* evaluator = nullptr;
+    uint64_t rollouts_played = 0;
+
+    monte_carlo_player(const piece_catalog& deck, thread_pool& workers)
+        : pieces(deck), catalog(deck.masks), pool(workers), scratches(workers.size()) {}
+
+    float rollout(scratch& s, const engine_state& start, const game_hand& hand, const placement& move, uint64_t seed){
+        game_rng rng(seed);
+        s.state = start;
+        s.hand = hand;
+        s.state.play(catalog[s.hand.pieces[move.slot]], move.row, move.col);
+        s.hand.remove(move.slot);
+
+        unsigned drawn = 0;
+        placement next;
+        while (true){
+            if (s.hand.count == 0){
+                if (drawn == horizon) break;
+                s.hand.draw(rng, pieces);
+                drawn++;
+            }
+            if (!random_placement(s.state.board, s.hand, catalog, rng, next)){
+                return (float)(s.state.score - start.score) - game_over_penalty;
+            }
+            s.state.play(catalog[s.hand.pieces[next.slot]], next.row, next.col);
+            s.hand.remove(next.slot);
+        }
+        float gain = (float)(s.state.score - start.score);
+        if (evaluator) gain += evaluator->evaluate(s.state.board, catalog);
+        return gain;
+    }
+
+    // Returns false if no piece of the hand fits.
+    bool choose(const engine_state& state, const game_hand& hand, uint64_t seed, placement& best){
+        candidates.clear();
+        for (unsigned slot = 0 ; slot < hand.count ; slot++){
+            bool repeated = false;
+            for (unsigned k = 0 ; k < slot ; k++){
+                if (hand.pieces[k] == hand.pieces[slot]) repeated = true;
+            }
+            if (repeated) continue;
+
+            uint64_t anchors = piece_placements(state.board, catalog[hand.pieces[slot]]);
+            for ( ; anchors ; anchors &= anchors - 1){
+                unsigned anchor = __builtin_ctzll(anchors);
+                placement p;
+                p.slot = slot;
+                p.row = anchor / BOARD_SIZE;
+                p.col = anchor % BOARD_SIZE;
+                candidates.push_back(p);
+            }
+        }
+
+        if (candidates.empty()) return false;
+        if (candidates.size() == 1 || rollouts == 0){
+            best = candidates[0];
+            return true;
+        }
+
+        outcomes.assign(candidates.size() * rollouts, 0);
+        pool.parallel_for(outcomes.size(), [&](unsigned worker, size_t i){
+            uint64_t task_seed = seed + i;
+            outcomes[i] = rollout(scratches[worker], state, hand, candidates[i / rollouts], game_rng::splitmix64(task_seed));
+        });
+        rollouts_played += outcomes.size();
+
+        float best_total = 0;
+        for (size_t c = 0 ; c < candidates.size() ; c++){
+            float total = 0;
+            for (unsigned k = 0 ; k < rollouts ; k++){
+                total += outcomes[c * rollouts + k];
+            }
+            if (c == 0 || total > best_total){
+                best_total = total;
+                best = candidates[c];
+            }
+        }
+        return true;
+    }
+};
+
+
+// Plays the placement with the best score gain plus evaluation of the board
+// it leaves, looking no further than the current move. With a danger
+// analyzer and a risk weight, placements that finish the hand also count the
+// chance of dying in the next one; earlier in the hand the rest of it is
+// known, so the risk term would not apply.
+struct greedy_player{
+    const std::vector<piece_mask>& catalog;
+    risk_evaluator evaluator;
+    danger_analyzer* danger = nullptr;
+
+    explicit greedy_player(const piece_catalog& pieces) : catalog(pieces.masks) {}
+
+    // Returns false if no piece of the hand fits.
+    bool choose(const engine_state& state, const game_hand& hand, placement& best) const {
+        bool found = false;
+        float best_value = 0;
+        bool risky = danger && evaluator.risk_weight != 0 && hand.count == 1;
+        for (unsigned slot = 0 ; slot < hand.count ; slot++){
+            bool repeated = false;
+            for (unsigned k = 0 ; k < slot ; k++){
+                if (hand.pieces[k] == hand.pieces[slot]) repeated = true;
+            }
+            if (repeated) continue;
+
+            const piece_mask& p = catalog[hand.pieces[slot]];
+            for (uint64_t anchors = piece_placements(state.board, p) ; anchors ; anchors &= anchors - 1){
+                unsigned anchor = __builtin_ctzll(anchors);
+                engine_state next = state;
+                next.play(p, anchor / BOARD_SIZE, anchor % BOARD_SIZE);
+
+                float value = (float)(next.score - state.score);
+                value += risky ? evaluator.evaluate(next.board, *danger, catalog) : evaluator.linear.evaluate(next.board, catalog);
+                if (!found || value > best_value){
+                    found = true;
+                    best_value = value;
+                    best.slot = slot;
+                    best.row = anchor / BOARD_SIZE;
+                    best.col = anchor % BOARD_SIZE;
+                }
+            }
+        }
+        return found;
+    }
+
+    // Plays one whole game (or max_moves moves) from a seed; returns the score.
+    uint32_t play_game(const piece_catalog& pieces, uint64_t seed, size_t max_moves) const {
+        game_rng rng(seed);
+        engine_state state;
+        game_hand hand;
+        hand.draw(rng, pieces);
+
+        placement move;
+        for (size_t moves = 0 ; moves < max_moves && choose(state, hand, move) ; moves++){
+            state.play(catalog[hand.pieces[move.slot]], move.row, move.col);
+            hand.remove(move.slot);
+            if (hand.count == 0) hand.draw(rng, pieces);
+        }
+        return state.score;
+    }
+};
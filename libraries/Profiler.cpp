@@ -0,0 +1,120 @@
+#pragma once
+
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+
+
+// Where run_game spends its time.
+enum game_phase{
+    PHASE_RENDER,
+    PHASE_INPUT,
+    PHASE_PLACE,
+    PHASE_CLEAR,
+    PHASE_PLAYABLE,
+    PHASE_DRAW,
+    PHASE_STATS_IO,
+    PHASE_COUNT
+};
+
+inline const char* phase_name(unsigned phase){
+    static const char* names[PHASE_COUNT] = {
+        "render", "input", "place_piece", "clear_lines", "is_playable", "draw hand", "stats io"
+    };
+    return names[phase];
+}
+
+// Durations are kept in power of two buckets of nanoseconds: bucket b holds
+// samples in [2^b, 2^(b+1)).
+const unsigned PROFILE_BUCKETS = 48;
+
+struct phase_profile{
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+    uint64_t buckets[PROFILE_BUCKETS] = {};
+
+    void add(uint64_t ns){
+        count++;
+        total_ns += ns;
+        if (ns > max_ns) max_ns = ns;
+        unsigned b = ns ? 63 - __builtin_clzll(ns) : 0;
+        buckets[b < PROFILE_BUCKETS ? b : PROFILE_BUCKETS - 1]++;
+    }
+
+    // Upper bound of the bucket holding the q-th quantile.
+    uint64_t percentile(double q) const {
+        uint64_t rank = (uint64_t)(q * (count ? count - 1 : 0));
+        uint64_t seen = 0;
+        for (unsigned b = 0 ; b < PROFILE_BUCKETS ; b++){
+            seen += buckets[b];
+            if (seen > rank) return (2ull << b) < max_ns ? (2ull << b) : max_ns;
+        }
+        return max_ns;
+    }
+};
+
+// Per-phase timings for the game loop. Off unless enabled, in which case
+// every timer costs two steady_clock reads (vDSO, no system call). SIGUSR1
+// asks for a summary at the next safe point.
+struct game_profiler{
+    static inline bool enabled = false;
+    static inline volatile std::sig_atomic_t dump_requested = 0;
+    static inline phase_profile phases[PHASE_COUNT];
+
+    static void on_signal(int){
+        dump_requested = 1;
+    }
+
+    static void enable(){
+        enabled = true;
+        std::signal(SIGUSR1, on_signal);
+    }
+
+    static void reset(){
+        for (unsigned i = 0 ; i < PHASE_COUNT ; i++){
+            phases[i] = phase_profile();
+        }
+    }
+
+    static void dump(std::ostream& os){
+        char line[160];
+        snprintf(line, sizeof(line), "%-18s %8s %12s %12s %12s %12s\n", "phase", "count", "mean us", "p50 us", "p99 us", "max us");
+        os << line;
+        for (unsigned i = 0 ; i < PHASE_COUNT ; i++){
+            const phase_profile& p = phases[i];
+            if (p.count == 0) continue;
+            snprintf(line, sizeof(line), "%-18s %8llu %12.2f %12.2f %12.2f %12.2f\n", phase_name(i), (unsigned long long)p.count,
+                     p.total_ns / 1000.0 / p.count, p.percentile(0.5) / 1000.0, p.percentile(0.99) / 1000.0, p.max_ns / 1000.0);
+            os << line;
+        }
+        os << std::endl;
+    }
+
+    // Prints the summary if SIGUSR1 arrived since the last call.
+    static void poll(std::ostream& os){
+        if (dump_requested){
+            dump_requested = 0;
+            dump(os);
+        }
+    }
+};
+
+class scoped_timer{
+private:
+    game_phase phase;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit scoped_timer(game_phase p) : phase(p) {
+        if (game_profiler::enabled) start = std::chrono::steady_clock::now();
+    }
+
+    ~scoped_timer(){
+        if (!game_profiler::enabled) return;
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        game_profiler::phases[phase].add(ns);
+    }
+};
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "Engine.cpp"
+#include "Catalog.cpp"
+
+
+// Everything one game needs between moves.
+struct game_session{
+    game_rng rng;
+    uint64_t board = 0;
+    uint32_t score = 0;
+    uint16_t combo = 0;
+    game_hand hand;
+    bool over = true;
+
+    void start(const piece_catalog& catalog, uint64_t seed){
+        rng.reseed(seed);
+        board = 0;
+        score = 0;
+        combo = 0;
+        hand.draw(rng, catalog);
+        over = false;
+    }
+
+    // 0-based slot, row and col. Returns false if the move is not legal.
+    bool play(const piece_catalog& catalog, unsigned slot, unsigned row, unsigned col){
+        if (over || slot >= hand.count) return false;
+
+        engine_state state;
+        state.board = board;
+        state.score = score;
+        state.combo = combo;
+        if (!state.play(catalog.masks[hand.pieces[slot]], row, col)) return false;
+
+        board = state.board;
+        score = state.score;
+        combo = state.combo;
+        hand.remove(slot);
+        if (hand.count == 0) hand.draw(rng, catalog);
+
+        over = !hand.playable(board, catalog.masks);
+        return true;
+    }
+};
+
+
+// Protocol for programs playing the game, shared by `main machine` (stdin /
+// stdout) and the server. Clients may send any number of commands without
+// waiting for replies; every command gets exactly one reply, in order.
+//
+// Text mode, one or more space separated commands per line:
+//   n[seed]      new game                    m<slot><row><col>   move, digits 1-based (m134)
+//   s            state                       b                   switch to binary frames
+//   q            quit
+// Replies:
+//   = <board as 16 hex digits> <hand ids, comma separated or -> <score> <combo> [over]
+//   ! <reason>
+// Bit (row * 8 + col) of the board is a filled cell. Hand ids are
+// piece_catalog ids. The longer commands new [seed], place <slot> <row>
+// <col>, board and quit are accepted too; board replies with the grid.
+//
+// Binary mode, one byte per move: slot | row << 2 | col << 5, all 0-based.
+// 0xFF followed by an 8 byte little endian seed starts a new game. Each
+// reply is one 18 byte state_frame: board (8), score (4), combo (1), flags
+// (1: bit 0 game over, bit 1 move rejected), hand size (1) and hand ids (3,
+// 0xFF where empty).
+struct state_frame{
+    uint64_t board;
+    uint32_t score;
+    uint8_t combo;
+    uint8_t flags;
+    uint8_t hand_size;
+    uint8_t hand[HAND_SIZE];
+} __attribute__((packed));
+static_assert(sizeof(state_frame) == 18, "state_frame layout changed");
+
+const uint8_t FRAME_GAME_OVER = 1;
+const uint8_t FRAME_REJECTED = 2;
+const uint8_t FRAME_NEW_GAME = 0xFF;
+
+class protocol_session{
+private:
+    game_session game;
+    std::string input;
+    bool binary = false;
+
+    void write_state(std::string& out){
+        char line[96];
+        int n = snprintf(line, sizeof(line), "= %016llx ", (unsigned long long)game.board);
+        out.append(line, n);
+
+        if (game.hand.count == 0 || game.over){
+            out += '-';
+        }
+        for (unsigned i = 0 ; i < game.hand.count && !game.over ; i++){
+            if (i) out += ',';
+            out += std::to_string(game.hand.pieces[i]);
+        }
+
+        n = snprintf(line, sizeof(line), " %u %u%s\n", game.score, game.combo, game.over ? " over" : "");
+        out.append(line, n);
+    }
+
+    void write_frame(std::string& out, bool rejected){
+        state_frame frame;
+        frame.board = game.board;
+        frame.score = game.score;
+        frame.combo = game.combo;
+        frame.flags = (game.over ? FRAME_GAME_OVER : 0) | (rejected ? FRAME_REJECTED : 0);
+        frame.hand_size = game.hand.count;
+        for (unsigned i = 0 ; i < HAND_SIZE ; i++){
+            frame.hand[i] = i < game.hand.count ? game.hand.pieces[i] : 0xFF;
+        }
+        out.append((const char*)&frame, sizeof(frame));
+    }
+
+    void write_board(std::string& out){
+        for (unsigned i = 0 ; i < BOARD_SIZE ; i++){
+            for (unsigned j = 0 ; j < BOARD_SIZE ; j++){
+                out += ((game.board >> (i * BOARD_SIZE + j)) & 1) ? "@ " : "` ";
+            }
+            out += '\n';
+        }
+        write_state(out);
+    }
+
+    static bool parse_number(const std::string& text, uint64_t& value){
+        if (text.empty()) return false;
+        value = 0;
+        for (char c : text){
+            if (c < '0' || c > '9') return false;
+            value = value * 10 + (c - '0');
+        }
+        return true;
+    }
+
+    static bool is_move(const std::string& w){
+        return w[0] == 'm' && w.size() == 4 && w[1] >= '1' && w[1] <= '3' && w[2] >= '1' && w[2] <= '8' && w[3] >= '1' && w[3] <= '8';
+    }
+
+    static bool is_command(const std::string& w){
+        uint64_t seed;
+        return w == "new" || w == "n" || (w[0] == 'n' && parse_number(w.substr(1), seed)) || w == "place" || is_move(w)
+            || w == "s" || w == "board" || w == "b" || w == "q" || w == "quit";
+    }
+
+    void move(const piece_catalog& catalog, unsigned slot, unsigned row, unsigned col, std::string& out){
+        if (game.over) out += "! no game in progress\n";
+        else if (!game.play(catalog, slot, row, col)) out += "! invalid move\n";
+        else write_state(out);
+    }
+
+    // Returns false on quit.
+    bool handle_line(const piece_catalog& catalog, const std::string& line, std::string& out){
+        std::vector<std::string> words;
+        size_t start = 0;
+        while (start < line.size()){
+            size_t end = line.find_first_of(" \t\r", start);
+            if (end == std::string::npos) end = line.size();
+            if (end > start) words.push_back(line.substr(start, end - start));
+            start = end + 1;
+        }
+
+        for (size_t i = 0 ; i < words.size() ; i++){
+            const std::string& w = words[i];
+            uint64_t value = 0;
+
+            if (w == "new" || w == "n" || (w[0] == 'n' && parse_number(w.substr(1), value))){
+                if (w == "new" && i + 1 < words.size() && parse_number(words[i + 1], value)) i++;
+                else if (w == "new" || w == "n") value = game_rng::make_seed() ^ (uint64_t)this;
+                game.start(catalog, value);
+                write_state(out);
+            }
+            else if (w == "place"){
+                uint64_t slot, row, col;
+                if (i + 3 >= words.size() || !parse_number(words[i + 1], slot) || !parse_number(words[i + 2], row) || !parse_number(words[i + 3], col)
+                    || slot == 0 || row == 0 || col == 0 || row > BOARD_SIZE || col > BOARD_SIZE){
+                    // One error for the whole command: skip what was meant as its
+                    // operands, up to the next word that starts a command.
+                    out += "! usage: place <slot> <row> <col>\n";
+                    for (unsigned k = 0 ; k < 3 && i + 1 < words.size() && !is_command(words[i + 1]) ; k++) i++;
+                    continue;
+                }
+                i += 3;
+                move(catalog, slot - 1, row - 1, col - 1, out);
+            }
+            else if (is_move(w)){
+                move(catalog, w[1] - '1', w[2] - '1', w[3] - '1', out);
+            }
+            else if (w == "s"){
+                write_state(out);
+            }
+            else if (w == "board"){
+                write_board(out);
+            }
+            else if (w == "b"){
+                binary = true;
+                out += "= binary\n";
+                return true;       // the rest of the stream is frames
+            }
+            else if (w == "q" || w == "quit"){
+                return false;
+            }
+            else{
+                out += "! unknown command " + w + "\n";
+            }
+        }
+        return true;
+    }
+
+public:
+    // Consumes whatever the client sent and appends the replies to out.
+    // Incomplete commands are kept for the next call. Returns false when the
+    // client quit.
+    bool feed(const piece_catalog& catalog, const char* data, size_t size, std::string& out){
+        input.append(data, size);
+        size_t start = 0;
+
+        while (start < input.size()){
+            if (binary){
+                uint8_t byte = input[start];
+                if (byte == FRAME_NEW_GAME){
+                    if (input.size() - start < 9) break;
+                    uint64_t seed;
+                    memcpy(&seed, input.data() + start + 1, 8);
+                    game.start(catalog, seed);
+                    write_frame(out, false);
+                    start += 9;
+                    continue;
+                }
+
+                unsigned slot = byte & 3, row = (byte >> 2) & 7, col = byte >> 5;
+                bool rejected = !game.play(catalog, slot, row, col);
+                write_frame(out, rejected);
+                start++;
+                continue;
+            }
+
+            size_t end = input.find('\n', start);
+            if (end == std::string::npos) break;
+
+            bool keep = handle_line(catalog, input.substr(start, end - start), out);
+            start = end + 1;
+            if (!keep){
+                input.clear();
+                return false;
+            }
+        }
+
+        input.erase(0, start);
+        return binary || input.size() < 4096;   // no sane line is this long
+    }
+};
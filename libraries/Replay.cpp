@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include "Engine.cpp"
+#include "Catalog.cpp"
+
+
+// A replay is the game seed followed by one 16-bit word per move:
+//   bits 0-1 hand slot, 2-5 shape index, 6-7 rotation, 8-10 row, 11-13 col.
+// The rotation counts the shape's distinct rotations (piece_catalog::rotation_of).
+// The seed reproduces every hand, so the whole game can be re-executed and
+// its score checked without any rendering. shape_set is the catalog's
+// fingerprint, so a replay is only checked against the shapes it was
+// recorded with.
+struct replay_header{
+    char magic[4] = {'T', 'B', 'R', 'P'};
+    uint16_t version = 4;
+    uint16_t shape_count = 0;
+    uint64_t seed = 0;
+    uint32_t moves = 0;
+    uint32_t final_score = 0;
+    uint64_t shape_set = 0;
+};
+static_assert(sizeof(replay_header) == 32, "replay_header layout changed");
+
+struct replay_move{
+    unsigned slot, shape, rotation, row, col;
+};
+
+inline uint16_t pack_move(unsigned slot, unsigned shape, unsigned rotation, unsigned row, unsigned col){
+    return slot | (shape << 2) | (rotation << 6) | (row << 8) | (col << 11);
+}
+
+inline replay_move unpack_move(uint16_t word){
+    replay_move m;
+    m.slot = word & 3;
+    m.shape = (word >> 2) & 15;
+    m.rotation = (word >> 6) & 3;
+    m.row = (word >> 8) & 7;
+    m.col = (word >> 11) & 7;
+    return m;
+}
+
+struct replay{
+    replay_header header;
+    std::vector<uint16_t> moves;
+
+    void record(unsigned slot, unsigned shape, unsigned rotation, unsigned row, unsigned col){
+        moves.push_back(pack_move(slot, shape, rotation, row, col));
+    }
+
+    bool save(const std::string& path){
+        header.moves = moves.size();
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) return false;
+        file.write((const char*)&header, sizeof(header));
+        file.write((const char*)moves.data(), moves.size() * sizeof(uint16_t));
+        return !file.fail();
+    }
+
+    static replay load(const std::string& path){
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()){
+            throw std::runtime_error("Error: Can't open replay " + path);
+        }
+
+        replay r;
+        replay_header expected;
+        if (!file.read((char*)&r.header, sizeof(r.header)) || memcmp(r.header.magic, expected.magic, 4) != 0){
+            throw std::runtime_error("Error: Not a replay file: " + path);
+        }
+        if (r.header.version != expected.version){
+            throw std::runtime_error("Error: Unsupported replay version in " + path);
+        }
+
+        // The move count is checked against what the file holds before
+        // anything is allocated for it.
+        std::streampos moves_start = file.tellg();
+        file.seekg(0, std::ios::end);
+        uint64_t available = (uint64_t)(file.tellg() - moves_start);
+        file.seekg(moves_start);
+        if (!file || (uint64_t)r.header.moves * sizeof(uint16_t) > available){
+            throw std::runtime_error("Error: Truncated replay " + path);
+        }
+
+        r.moves.resize(r.header.moves);
+        if (!file.read((char*)r.moves.data(), r.moves.size() * sizeof(uint16_t))){
+            throw std::runtime_error("Error: Truncated replay " + path);
+        }
+        return r;
+    }
+};
+
+struct replay_result{
+    bool ok = false;
+    uint32_t score = 0;
+    size_t moves_played = 0;
+    std::string error;
+};
+
+// Re-executes a replay with the catalog the game drew from.
+inline replay_result verify_replay(const replay& r, const piece_catalog& catalog){
+    replay_result result;
+    const std::vector<piece_mask>& pieces = catalog.masks;
+
+    if (r.header.shape_count != catalog.shape_count || r.header.shape_set != catalog.fingerprint){
+        result.error = "replay was recorded with a different shape set";
+        return result;
+    }
+
+    game_rng rng(r.header.seed);
+    engine_state state;
+    game_hand hand;
+    hand.draw(rng, catalog);
+
+    for (size_t k = 0 ; k < r.moves.size() ; k++){
+        replay_move m = unpack_move(r.moves[k]);
+        result.moves_played = k;
+
+        if (!hand.playable(state.board, pieces)){
+            result.error = "move " + std::to_string(k + 1) + " comes after game over";
+            return result;
+        }
+        if (m.slot >= hand.count || catalog.shape_of[hand.pieces[m.slot]] != m.shape || catalog.rotation_of[hand.pieces[m.slot]] != m.rotation){
+            result.error = "move " + std::to_string(k + 1) + " uses a piece that is not in the hand";
+            return result;
+        }
+        if (!state.play(pieces[hand.pieces[m.slot]], m.row, m.col)){
+            result.error = "move " + std::to_string(k + 1) + " is not a legal placement";
+            return result;
+        }
+
+        hand.remove(m.slot);
+        if (hand.count == 0) hand.draw(rng, catalog);
+    }
+
+    result.moves_played = r.moves.size();
+    result.score = state.score;
+
+    if (hand.playable(state.board, pieces)){
+        result.error = "replay ends before game over";
+    }
+    else if (state.score != r.header.final_score){
+        result.error = "score mismatch: recorded " + std::to_string(r.header.final_score) + ", replayed " + std::to_string(state.score);
+    }
+    else{
+        result.ok = true;
+    }
+    return result;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Engine.cpp"
+#include "Undo.cpp"
+
+
+// A suspended game as one fixed-size record: the position (board, hand,
+// score, combo and generator state), the tallies for the game history and
+// the display settings the game was started with. Records are read and
+// written whole, with no parsing, so a host can keep any number of them in
+// one file at slot * sizeof(saved_game) and resume one with a single pread.
+// shape_set is the catalog's fingerprint: a game only resumes with the
+// shapes it was played with.
+struct saved_game{
+    char magic[4] = {'T', 'B', 'S', 'G'};
+    uint16_t version = 2;
+    uint16_t shape_count = 0;
+    uint64_t seed = 0;
+    uint64_t rng[4] = {};
+    uint64_t board = 0;
+    uint32_t score = 0;
+    uint32_t combo = 0;
+    uint32_t shapes_placed = 0;
+    uint32_t lines_cleared = 0;
+    uint32_t max_combo = 0;
+    uint32_t elapsed_ms = 0;
+    uint8_t hand[HAND_SIZE] = {};
+    uint8_t hand_count = 0;
+    uint8_t grid_space = 1;
+    uint8_t record_replays = 0;
+    uint8_t risk_meter = 0;
+    char block_symbol[16] = {};         // NUL terminated
+    char non_block_symbol[16] = {};
+    uint8_t padding = 0;
+    uint64_t shape_set = 0;
+
+    void set_position(const game_position& p){
+        memcpy(rng, p.rng.state, sizeof(rng));
+        board = p.state.board;
+        score = p.state.score;
+        combo = p.state.combo;
+        memcpy(hand, p.hand.pieces, sizeof(hand));
+        hand_count = p.hand.count;
+    }
+
+    game_position position() const {
+        game_position p;
+        memcpy(p.rng.state, rng, sizeof(rng));
+        p.state.board = board;
+        p.state.score = score;
+        p.state.combo = combo;
+        memcpy(p.hand.pieces, hand, sizeof(hand));
+        p.hand.count = hand_count;
+        return p;
+    }
+
+    static void set_symbol(char* field, const std::string& symbol){
+        size_t n = symbol.size() < 15 ? symbol.size() : 15;
+        memcpy(field, symbol.data(), n);
+        field[n] = 0;
+    }
+
+    bool valid() const {
+        saved_game expected;
+        return memcmp(magic, expected.magic, 4) == 0 && version == expected.version && hand_count <= HAND_SIZE;
+    }
+
+    // True if the game was saved with this shape set and every piece in the
+    // hand is one of its ids, so resuming cannot index past the catalog.
+    bool matches(const piece_catalog& catalog) const {
+        if (shape_count != catalog.shape_count || shape_set != catalog.fingerprint || hand_count == 0) return false;
+        for (unsigned i = 0 ; i < hand_count ; i++){
+            if (hand[i] >= catalog.size()) return false;
+        }
+        return true;
+    }
+};
+static_assert(sizeof(saved_game) == 128, "saved_game layout changed");
+
+inline bool write_saved_game(int fd, size_t slot, const saved_game& game){
+    return pwrite(fd, &game, sizeof(game), slot * sizeof(game)) == (ssize_t)sizeof(game);
+}
+
+// Returns false if the slot is past the end of the file or holds no game.
+inline bool read_saved_game(int fd, size_t slot, saved_game& game){
+    return pread(fd, &game, sizeof(game), slot * sizeof(game)) == (ssize_t)sizeof(game) && game.valid();
+}
+
+// A single saved game in its own file, replaced atomically.
+inline bool save_game_file(const std::string& path, const saved_game& game){
+    std::string tmp_path = path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = write_saved_game(fd, 0, game);
+    ok = close(fd) == 0 && ok;
+    return ok && rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+inline bool load_game_file(const std::string& path, saved_game& game){
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool ok = read_saved_game(fd, 0, game);
+    close(fd);
+    return ok;
+}
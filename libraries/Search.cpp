@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "Engine.cpp"
+
+
+// Counts every sequence of `depth` placements from a board and a hand: each
+// ply takes any remaining piece at any legal anchor, then clears full lines.
+// Pieces are catalog ids; hand[0..count) is reordered while searching but
+// restored before returning.
+inline uint64_t perft(uint64_t board, uint8_t* hand, unsigned count, unsigned depth, const std::vector<piece_mask>& catalog){
+    if (depth == 0) return 1;
+
+    uint64_t nodes = 0;
+    for (unsigned slot = 0 ; slot < count ; slot++){
+        const piece_mask& p = catalog[hand[slot]];
+        uint64_t anchors = piece_placements(board, p);
+
+        if (depth == 1){
+            nodes += __builtin_popcountll(anchors);
+            continue;
+        }
+
+        // Move the chosen piece to the end so the rest stay contiguous.
+        uint8_t chosen = hand[slot];
+        hand[slot] = hand[count - 1];
+        hand[count - 1] = chosen;
+
+        for ( ; anchors ; anchors &= anchors - 1){
+            uint64_t next = board | (p.mask << __builtin_ctzll(anchors));
+            clear_full_lines(next);
+            nodes += perft(next, hand, count - 1, depth - 1, catalog);
+        }
+
+        hand[count - 1] = hand[slot];
+        hand[slot] = chosen;
+    }
+    return nodes;
+}
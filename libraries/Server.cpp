@@ -0,0 +1,210 @@
+#pragma once
+
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Engine.cpp"
+#include "Protocol.cpp"
+
+
+// Replies a connection may have waiting before the server stops reading its
+// commands, so a client that sends without reading can't grow the buffer
+// without bound. One read can add up to about 74 KB (binary frames).
+const size_t SERVER_OUTPUT_LIMIT = 1 << 20;
+
+struct server_connection{
+    int fd = -1;
+    protocol_session session;
+    std::string output;
+    bool closing = false;   // no more input; closed once the output is sent
+};
+
+
+// Hosts many game sessions in one process. Each worker thread runs its own
+// epoll loop and accepts from the shared listening socket, and a connection
+// stays on the thread that accepted it. Clients speak the protocol in
+// Protocol.cpp.
+class game_server{
+private:
+    const piece_catalog& catalog;
+    int listen_fd = -1;
+
+    static void set_non_blocking(int fd){
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    void close_connection(int epoll_fd, server_connection* c){
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, nullptr);
+        close(c->fd);
+        delete c;
+    }
+
+    // Sends as much pending output as the socket takes and waits for
+    // EPOLLOUT only while something is left, and for input only while the
+    // output is under the limit and the client may still send. Returns false
+    // when the connection should be closed: on errors, and for a closing
+    // connection once everything is sent.
+    bool flush_output(int epoll_fd, server_connection* c){
+        while (!c->output.empty()){
+            ssize_t n = send(c->fd, c->output.data(), c->output.size(), MSG_NOSIGNAL);
+            if (n < 0){
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return false;
+            }
+            c->output.erase(0, n);
+        }
+        if (c->closing && c->output.empty()) return false;
+
+        epoll_event ev{};
+        ev.events = (!c->closing && c->output.size() < SERVER_OUTPUT_LIMIT ? (uint32_t)(EPOLLIN | EPOLLRDHUP) : (uint32_t)0)
+                  | (c->output.empty() ? (uint32_t)0 : (uint32_t)EPOLLOUT);
+        ev.data.ptr = c;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+        return true;
+    }
+
+    // Returns false on errors. When the client is done sending (end of
+    // stream or the session ended), the connection is marked closing, so the
+    // replies still waiting are sent before it is closed.
+    bool read_input(server_connection* c){
+        char buffer[4096];
+        while (!c->closing && c->output.size() < SERVER_OUTPUT_LIMIT){
+            ssize_t n = recv(c->fd, buffer, sizeof(buffer), 0);
+            if (n == 0){
+                c->closing = true;
+                break;
+            }
+            if (n < 0){
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return false;
+            }
+            if (!c->session.feed(catalog, buffer, n, c->output)) c->closing = true;
+        }
+        return true;
+    }
+
+    void worker_loop(int epoll_fd){
+        epoll_event events[256];
+        while (true){
+            int n = epoll_wait(epoll_fd, events, 256, -1);
+            if (n < 0){
+                if (errno == EINTR) continue;
+                break;
+            }
+
+            for (int i = 0 ; i < n ; i++){
+                if (events[i].data.ptr == nullptr){
+                    while (true){
+                        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                        if (fd < 0) break;
+
+                        server_connection* c = new server_connection();
+                        c->fd = fd;
+                        epoll_event client{};
+                        client.events = EPOLLIN | EPOLLRDHUP;
+                        client.data.ptr = c;
+                        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &client);
+                    }
+                    continue;
+                }
+
+                server_connection* c = (server_connection*)events[i].data.ptr;
+                bool keep = true;
+
+                if (!c->closing && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))){
+                    keep = read_input(c);
+                }
+                if (!keep || !flush_output(epoll_fd, c)) close_connection(epoll_fd, c);
+            }
+        }
+        close(epoll_fd);
+    }
+
+public:
+    explicit game_server(const piece_catalog& pieces) : catalog(pieces) {}
+
+    ~game_server(){
+        if (listen_fd >= 0) close(listen_fd);
+    }
+
+    void listen_tcp(uint16_t port){
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0){
+            throw std::runtime_error(std::string("Error: Can't create socket: ") + strerror(errno));
+        }
+        int yes = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, SOMAXCONN) < 0){
+            throw std::runtime_error("Error: Can't listen on port " + std::to_string(port));
+        }
+        set_non_blocking(listen_fd);
+    }
+
+    void listen_unix(const std::string& path){
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0){
+            throw std::runtime_error(std::string("Error: Can't create socket: ") + strerror(errno));
+        }
+
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)){
+            throw std::runtime_error("Error: Socket path too long!");
+        }
+        strcpy(addr.sun_path, path.c_str());
+        unlink(path.c_str());
+
+        if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, SOMAXCONN) < 0){
+            throw std::runtime_error("Error: Can't listen on " + path);
+        }
+        set_non_blocking(listen_fd);
+    }
+
+    // Blocks, serving clients on `threads` event loops. Throws if the
+    // loops can't be set up.
+    void run(unsigned threads){
+        if (threads == 0) threads = 1;
+
+        std::vector<int> epoll_fds;
+        for (unsigned i = 0 ; i < threads ; i++){
+            int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+            ev.data.ptr = nullptr;
+            if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0){
+                std::string error = strerror(errno);
+                if (epoll_fd >= 0) close(epoll_fd);
+                for (int fd : epoll_fds) close(fd);
+                throw std::runtime_error("Error: Can't create event loop: " + error);
+            }
+            epoll_fds.push_back(epoll_fd);
+        }
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 1 ; i < threads ; i++){
+            workers.emplace_back(&game_server::worker_loop, this, epoll_fds[i]);
+        }
+        worker_loop(epoll_fds[0]);
+
+        for (std::thread& t : workers){
+            t.join();
+        }
+    }
+};
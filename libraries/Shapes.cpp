@@ -0,0 +1,99 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include "Engine.cpp"
+
+
+// The built-in shapes, rows separated by '/'. Everything derived from them
+// (masks, distinct rotations, cell counts, bounding boxes) is computed at
+// compile time into BUILT_IN_PIECES.
+constexpr const char* BUILT_IN_SHAPES[] = {
+    "***",
+    "****",
+    "*****",
+    "**/**",
+    "***/***",
+    "***/***/***",
+    "*./**",
+    ".*./***",
+    "..*/***",
+    "*../***",
+    "*../*../***",
+    "*./.*",
+    "*../.*./..*",
+    ".**/**.",
+    "**./.**",
+};
+constexpr unsigned BUILT_IN_SHAPE_COUNT = sizeof(BUILT_IN_SHAPES) / sizeof(BUILT_IN_SHAPES[0]);
+
+constexpr piece_mask piece_from_art(const char* art){
+    uint64_t mask = 0;
+    unsigned row = 0, col = 0, cols = 0;
+    for ( ; *art ; art++){
+        if (*art == '/'){
+            row++;
+            col = 0;
+            continue;
+        }
+        if (*art == '*') mask |= 1ull << (row * BOARD_SIZE + col);
+        col++;
+        if (col > cols) cols = col;
+    }
+    return make_piece(mask, row + 1, cols);
+}
+
+// The piece's distinct rotations in the order 0, 90, 180 and 270 degrees.
+// Returns how many there are.
+constexpr unsigned distinct_rotations(const piece_mask& p, piece_mask out[4]){
+    unsigned count = 0;
+    piece_mask rotated = p;
+    for (unsigned r = 0 ; r < 4 ; r++, rotated = rotate_piece(rotated)){
+        bool seen = false;
+        for (unsigned i = 0 ; i < count ; i++){
+            if (out[i].mask == rotated.mask) seen = true;
+        }
+        if (!seen) out[count++] = rotated;
+    }
+    return count;
+}
+
+struct built_in_piece{
+    piece_mask piece;
+    uint8_t shape = 0;
+    uint8_t rotation = 0;
+};
+
+constexpr unsigned count_built_in_pieces(){
+    unsigned count = 0;
+    for (unsigned s = 0 ; s < BUILT_IN_SHAPE_COUNT ; s++){
+        piece_mask rotations[4];
+        count += distinct_rotations(piece_from_art(BUILT_IN_SHAPES[s]), rotations);
+    }
+    return count;
+}
+
+constexpr unsigned BUILT_IN_PIECE_COUNT = count_built_in_pieces();
+
+constexpr std::array<built_in_piece, BUILT_IN_PIECE_COUNT> make_built_in_pieces(){
+    std::array<built_in_piece, BUILT_IN_PIECE_COUNT> pieces;
+    unsigned id = 0;
+    for (unsigned s = 0 ; s < BUILT_IN_SHAPE_COUNT ; s++){
+        piece_mask rotations[4];
+        unsigned count = distinct_rotations(piece_from_art(BUILT_IN_SHAPES[s]), rotations);
+        uint64_t siblings = ((1ull << count) - 1) << id;
+        for (unsigned r = 0 ; r < count ; r++, id++){
+            pieces[id].piece = rotations[r];
+            pieces[id].piece.rotations = siblings;
+            pieces[id].shape = s;
+            pieces[id].rotation = r;
+        }
+    }
+    return pieces;
+}
+
+// By piece id, in piece_catalog order.
+constexpr std::array<built_in_piece, BUILT_IN_PIECE_COUNT> BUILT_IN_PIECES = make_built_in_pieces();
+
+static_assert(BUILT_IN_PIECES[0].piece.cells == 3 && BUILT_IN_PIECES[0].piece.rows == 1 && BUILT_IN_PIECES[0].piece.cols == 3,
+              "built-in shapes are not compiled as expected");
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "Matrix.cpp"
+
+
+// Compressed sparse row matrix: for row i, the non-zero elements are
+// VALUES[ROW_START[i] .. ROW_START[i + 1]) in columns COLUMNS[...], sorted.
+// Storage is proportional to the non-zeros. transpose() gives the same
+// arrays a compressed sparse column layout of this matrix would have.
+//
+// Products with vectors and dense matrices can be split over threads; rows
+// are divided so every thread gets about the same number of non-zeros.
+// Dense operands and results are row major; the ColumnMajor overloads
+// convert through row major order.
+template <typename T>
+class SparseMatrix{
+private:
+    unsigned ROWS, COLS;
+    std::vector<size_t> ROW_START;
+    std::vector<unsigned> COLUMNS;
+    std::vector<T> VALUES;
+
+    template <typename Func>
+    void for_row_ranges(unsigned threads, Func func) const {
+        if (threads <= 1 || ROWS < 2 * threads){
+            func(0u, ROWS);
+            return;
+        }
+
+        std::vector<std::thread> workers;
+        unsigned first = 0;
+        for (unsigned t = 1 ; t <= threads ; t++){
+            unsigned last = ROWS;
+            if (t < threads){
+                size_t target = VALUES.size() * t / threads;
+                last = std::upper_bound(ROW_START.begin(), ROW_START.end(), target) - ROW_START.begin() - 1;
+                if (last < first) last = first;
+            }
+            if (last > first) workers.emplace_back(func, first, last);
+            first = last;
+        }
+        for (std::thread& w : workers) w.join();
+    }
+
+    // Row by row merge of two matrices of the same size. Positions present in
+    // only one of them are combined with zero, unless intersect is set, in
+    // which case they are dropped. Zero results are not stored.
+    template <typename Op>
+    SparseMatrix merge(const SparseMatrix& m, Op op, bool intersect) const {
+        if (ROWS != m.ROWS || COLS != m.COLS){
+            throw std::runtime_error("Error: Size mismatch!");
+        }
+
+        SparseMatrix S(ROWS, COLS);
+        for (unsigned i = 0 ; i < ROWS ; i++){
+            size_t a = ROW_START[i], a_end = ROW_START[i + 1];
+            size_t b = m.ROW_START[i], b_end = m.ROW_START[i + 1];
+            while (a < a_end || b < b_end){
+                unsigned col;
+                T value;
+                if (b == b_end || (a < a_end && COLUMNS[a] < m.COLUMNS[b])){
+                    col = COLUMNS[a];
+                    value = intersect ? T() : op(VALUES[a], T());
+                    a++;
+                }
+                else if (a == a_end || m.COLUMNS[b] < COLUMNS[a]){
+                    col = m.COLUMNS[b];
+                    value = intersect ? T() : op(T(), m.VALUES[b]);
+                    b++;
+                }
+                else{
+                    col = COLUMNS[a];
+                    value = op(VALUES[a], m.VALUES[b]);
+                    a++;
+                    b++;
+                }
+                if (value != T()){
+                    S.COLUMNS.push_back(col);
+                    S.VALUES.push_back(value);
+                }
+            }
+            S.ROW_START[i + 1] = S.VALUES.size();
+        }
+        return S;
+    }
+
+public:
+    struct triplet{
+        unsigned row, col;
+        T value;
+    };
+
+    // An all-zero matrix.
+    SparseMatrix(unsigned r = 1, unsigned c = 1) : ROWS(r), COLS(c), ROW_START(r + 1, 0) {
+        static_assert(AllowType<T>::allowed, "Error: This type is not supported in SparseMatrix!");
+    }
+
+    static SparseMatrix from_dense(const Matrix<T>& m){
+        SparseMatrix S(m.get_rows(), m.get_cols());
+        const T* data = m.data();
+        for (unsigned i = 0 ; i < S.ROWS ; i++){
+            for (unsigned j = 0 ; j < S.COLS ; j++){
+                if (data[(size_t)i * S.COLS + j] != T()){
+                    S.COLUMNS.push_back(j);
+                    S.VALUES.push_back(data[(size_t)i * S.COLS + j]);
+                }
+            }
+            S.ROW_START[i + 1] = S.VALUES.size();
+        }
+        return S;
+    }
+
+    static SparseMatrix from_dense(const Matrix<T, ColumnMajor>& m){
+        return from_dense(m.template to_layout<RowMajor>());
+    }
+
+    // Entries may come in any order; entries for the same position are added.
+    static SparseMatrix from_triplets(unsigned rows, unsigned cols, std::vector<triplet> entries){
+        for (const triplet& e : entries){
+            if (e.row >= rows || e.col >= cols){
+                throw std::runtime_error("Error: Invalid index!");
+            }
+        }
+        std::sort(entries.begin(), entries.end(), [](const triplet& a, const triplet& b){
+            return a.row != b.row ? a.row < b.row : a.col < b.col;
+        });
+
+        SparseMatrix S(rows, cols);
+        for (size_t k = 0 ; k < entries.size() ; ){
+            triplet e = entries[k++];
+            while (k < entries.size() && entries[k].row == e.row && entries[k].col == e.col){
+                e.value += entries[k++].value;
+            }
+            if (e.value == T()) continue;
+            S.COLUMNS.push_back(e.col);
+            S.VALUES.push_back(e.value);
+            S.ROW_START[e.row + 1]++;
+        }
+        for (unsigned i = 0 ; i < rows ; i++){
+            S.ROW_START[i + 1] += S.ROW_START[i];
+        }
+        return S;
+    }
+
+    Matrix<T> to_dense() const {
+        Matrix<T> M(ROWS, COLS);
+        T* data = M.data();
+        for (unsigned i = 0 ; i < ROWS ; i++){
+            for (size_t k = ROW_START[i] ; k < ROW_START[i + 1] ; k++){
+                data[(size_t)i * COLS + COLUMNS[k]] = VALUES[k];
+            }
+        }
+        return M;
+    }
+
+    unsigned get_rows() const { return ROWS; }
+    unsigned get_cols() const { return COLS; }
+    size_t non_zeros() const { return VALUES.size(); }
+
+    const std::vector<size_t>& row_start() const { return ROW_START; }
+    const std::vector<unsigned>& columns() const { return COLUMNS; }
+    const std::vector<T>& values() const { return VALUES; }
+
+    T get(unsigned row, unsigned col) const {
+        if (row >= ROWS || col >= COLS){
+            throw std::runtime_error("Error: Invalid index!");
+        }
+        auto begin = COLUMNS.begin() + ROW_START[row], end = COLUMNS.begin() + ROW_START[row + 1];
+        auto it = std::lower_bound(begin, end, col);
+        return (it != end && *it == col) ? VALUES[it - COLUMNS.begin()] : T();
+    }
+
+    // Counting sort by column, O(non-zeros + cols).
+    SparseMatrix transpose() const {
+        SparseMatrix S(COLS, ROWS);
+        S.COLUMNS.resize(VALUES.size());
+        S.VALUES.resize(VALUES.size());
+
+        for (unsigned col : COLUMNS) S.ROW_START[col + 1]++;
+        for (unsigned j = 0 ; j < COLS ; j++) S.ROW_START[j + 1] += S.ROW_START[j];
+
+        std::vector<size_t> next(S.ROW_START.begin(), S.ROW_START.end() - 1);
+        for (unsigned i = 0 ; i < ROWS ; i++){
+            for (size_t k = ROW_START[i] ; k < ROW_START[i + 1] ; k++){
+                size_t to = next[COLUMNS[k]]++;
+                S.COLUMNS[to] = i;
+                S.VALUES[to] = VALUES[k];
+            }
+        }
+        return S;
+    }
+
+    // Sparse matrix times dense vector.
+    std::vector<T> multiply(const std::vector<T>& x, unsigned threads = 1) const {
+        if (x.size() != COLS){
+            throw std::runtime_error("Error: Can't multiply!");
+        }
+        std::vector<T> y(ROWS);
+        for_row_ranges(threads, [&](unsigned first, unsigned last){
+            for (unsigned i = first ; i < last ; i++){
+                T value = T();
+                for (size_t k = ROW_START[i] ; k < ROW_START[i + 1] ; k++){
+                    value += VALUES[k] * x[COLUMNS[k]];
+                }
+                y[i] = value;
+            }
+        });
+        return y;
+    }
+
+    // Sparse times dense: each non-zero adds a scaled row of m to a row of
+    // the result, so the inner loop runs over contiguous elements.
+    Matrix<T> multiply(const Matrix<T>& m, unsigned threads = 1) const {
+        if (COLS != m.get_rows()){
+            throw std::runtime_error("Error: Can't multiply!");
+        }
+        unsigned n = m.get_cols();
+        Matrix<T> M(ROWS, n);
+        T* out = M.data();
+        const T* in = m.data();
+
+        for_row_ranges(threads, [&](unsigned first, unsigned last){
+            for (unsigned i = first ; i < last ; i++){
+                T* row = out + (size_t)i * n;
+                for (size_t k = ROW_START[i] ; k < ROW_START[i + 1] ; k++){
+                    const T* other = in + (size_t)COLUMNS[k] * n;
+                    T v = VALUES[k];
+                    for (unsigned j = 0 ; j < n ; j++){
+                        row[j] += v * other[j];
+                    }
+                }
+            }
+        });
+        return M;
+    }
+
+    Matrix<T, ColumnMajor> multiply(const Matrix<T, ColumnMajor>& m, unsigned threads = 1) const {
+        return multiply(m.template to_layout<RowMajor>(), threads).template to_layout<ColumnMajor>();
+    }
+
+    // Sparse times sparse (Gustavson): one dense accumulator row, reset only
+    // where it was touched.
+    SparseMatrix multiply(const SparseMatrix& m) const {
+        if (COLS != m.ROWS){
+            throw std::runtime_error("Error: Can't multiply!");
+        }
+        SparseMatrix S(ROWS, m.COLS);
+        std::vector<T> accumulator(m.COLS);
+        std::vector<bool> touched(m.COLS);
+        std::vector<unsigned> used;
+
+        for (unsigned i = 0 ; i < ROWS ; i++){
+            used.clear();
+            for (size_t k = ROW_START[i] ; k < ROW_START[i + 1] ; k++){
+                unsigned r = COLUMNS[k];
+                for (size_t l = m.ROW_START[r] ; l < m.ROW_START[r + 1] ; l++){
+                    unsigned col = m.COLUMNS[l];
+                    if (!touched[col]){
+                        touched[col] = true;
+                        used.push_back(col);
+                    }
+                    accumulator[col] += VALUES[k] * m.VALUES[l];
+                }
+            }
+
+            std::sort(used.begin(), used.end());
+            for (unsigned col : used){
+                if (accumulator[col] != T()){
+                    S.COLUMNS.push_back(col);
+                    S.VALUES.push_back(accumulator[col]);
+                }
+                accumulator[col] = T();
+                touched[col] = false;
+            }
+            S.ROW_START[i + 1] = S.VALUES.size();
+        }
+        return S;
+    }
+
+    SparseMatrix operator+(const SparseMatrix& m) const { return merge(m, [](T a, T b){ return a + b; }, false); }
+    SparseMatrix operator-(const SparseMatrix& m) const { return merge(m, [](T a, T b){ return a - b; }, false); }
+
+    // Element by element product.
+    SparseMatrix hadamard(const SparseMatrix& m) const { return merge(m, [](T a, T b){ return a * b; }, true); }
+
+    SparseMatrix operator*(T scalar) const {
+        if (scalar == T()) return SparseMatrix(ROWS, COLS);
+        SparseMatrix S = *this;
+        for (T& v : S.VALUES) v *= scalar;
+        return S;
+    }
+
+    SparseMatrix operator*(const SparseMatrix& m) const { return multiply(m); }
+    Matrix<T> operator*(const Matrix<T>& m) const { return multiply(m); }
+    Matrix<T, ColumnMajor> operator*(const Matrix<T, ColumnMajor>& m) const { return multiply(m); }
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Fixed set of worker threads running one parallel_for at a time. Indices are
+// handed out dynamically, and the calling thread works too, as worker 0.
+class thread_pool{
+private:
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable finished;
+
+    std::function<void(unsigned, size_t)> job;
+    std::atomic<size_t> next{0};
+    size_t total = 0;
+    unsigned busy = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+
+    void run_job(unsigned worker){
+        for (size_t i = next.fetch_add(1) ; i < total ; i = next.fetch_add(1)){
+            job(worker, i);
+        }
+    }
+
+    void worker_loop(unsigned worker){
+        uint64_t seen = 0;
+        while (true){
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [&]{ return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+
+            run_job(worker);
+
+            std::lock_guard<std::mutex> guard(lock);
+            if (--busy == 0) finished.notify_one();
+        }
+    }
+
+public:
+    // 0 threads means one per hardware thread.
+    explicit thread_pool(unsigned threads = 0){
+        if (threads == 0) threads = std::thread::hardware_concurrency();
+        if (threads == 0) threads = 1;
+
+        for (unsigned i = 1 ; i < threads ; i++){
+            workers.emplace_back(&thread_pool::worker_loop, this, i);
+        }
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    ~thread_pool(){
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& t : workers){
+            t.join();
+        }
+    }
+
+    unsigned size() const { return workers.size() + 1; }
+
+    // Calls func(worker, i) for every i in [0, count) and waits for all of
+    // them. worker is in [0, size()) and can index per-thread scratch data.
+    void parallel_for(size_t count, std::function<void(unsigned, size_t)> func){
+        if (workers.empty() || count <= 1){
+            for (size_t i = 0 ; i < count ; i++){
+                func(0, i);
+            }
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            job = std::move(func);
+            total = count;
+            next = 0;
+            busy = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+
+        run_job(0);
+
+        std::unique_lock<std::mutex> guard(lock);
+        finished.wait(guard, [&]{ return busy == 0; });
+        job = nullptr;
+    }
+};
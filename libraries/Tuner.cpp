@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "Engine.cpp"
+#include "Features.cpp"
+#include "ThreadPool.cpp"
+#include "Catalog.cpp"
+#include "Danger.cpp"
+#include "Player.cpp"
+
+
+struct tuner_candidate{
+    float weights[FEATURE_COUNT] = {};
+    float risk_weight = 0;  // see risk_evaluator; 0 unless the tuner evolves it
+    double fitness = 0;     // mean score of the last generation's games
+};
+
+// Genetic algorithm over linear_evaluator weights. Every candidate plays the
+// same seeded games with greedy_player, so candidates are compared on equal
+// hands, and the seeds change every generation so no one overfits them. All
+// games of a generation are spread over the pool, one game per task. With
+// risk set, the weight of the danger term is evolved too; those games run an
+// analyzer of their own on the task's thread, so they are much slower.
+//
+// The whole state (population, generation, generator) fits in a small text
+// checkpoint, written after every generation.
+class weight_tuner{
+private:
+    const piece_catalog& catalog;
+    thread_pool& pool;
+    std::vector<uint32_t> scores;
+
+    double uniform(){
+        return (rng.next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    double gaussian(){
+        double u = uniform(), v = uniform();
+        return std::sqrt(-2.0 * std::log(1.0 - u)) * std::cos(6.283185307179586 * v);
+    }
+
+    const tuner_candidate& tournament(){
+        const tuner_candidate* best = &population[rng.below(population.size())];
+        for (unsigned k = 1 ; k < 3 ; k++){
+            const tuner_candidate* other = &population[rng.below(population.size())];
+            if (other->fitness > best->fitness) best = other;
+        }
+        return *best;
+    }
+
+    void mutate(tuner_candidate& c){
+        for (unsigned i = 0 ; i < FEATURE_COUNT ; i++){
+            if (uniform() < 2.0 / FEATURE_COUNT){
+                c.weights[i] += mutation * (std::fabs(c.weights[i]) + 0.5) * gaussian();
+            }
+        }
+        if (risk && uniform() < 2.0 / FEATURE_COUNT){
+            c.risk_weight += mutation * (std::fabs(c.risk_weight) + 0.5) * gaussian();
+        }
+    }
+
+public:
+    std::vector<tuner_candidate> population;
+    unsigned generation = 0;
+    game_rng rng;
+
+    unsigned games = 64;            // games per candidate per generation
+    size_t max_moves = 2000;        // caps games that would go on for very long
+    unsigned elite = 2;             // best candidates kept as they are
+    double mutation = 0.3;
+    bool risk = false;
+
+    weight_tuner(const piece_catalog& pieces, thread_pool& workers, uint64_t seed)
+        : catalog(pieces), pool(workers), rng(seed) {}
+
+    // The start weights and size - 1 mutated copies of them.
+    void initialize(const linear_evaluator& start, unsigned size){
+        population.assign(size, tuner_candidate());
+        for (unsigned c = 0 ; c < size ; c++){
+            std::copy(start.weights, start.weights + FEATURE_COUNT, population[c].weights);
+            population[c].risk_weight = risk ? risk_evaluator::START_RISK_WEIGHT : 0;
+            if (c) mutate(population[c]);
+        }
+        generation = 0;
+    }
+
+    // Plays every candidate's games and sorts the population, best first.
+    void evaluate(){
+        uint64_t base = rng.next();
+        scores.assign(population.size() * games, 0);
+
+        pool.parallel_for(scores.size(), [&](unsigned, size_t i){
+            const tuner_candidate& c = population[i / games];
+            greedy_player player(catalog);
+            std::copy(c.weights, c.weights + FEATURE_COUNT, player.evaluator.linear.weights);
+            player.evaluator.risk_weight = c.risk_weight;
+            uint64_t seed = base + i % games;
+
+            if (c.risk_weight == 0){
+                scores[i] = player.play_game(catalog, game_rng::splitmix64(seed), max_moves);
+                return;
+            }
+            thread_pool inline_pool(1);
+            danger_analyzer danger(catalog.masks, inline_pool);
+            danger.set_weights(catalog.probabilities);
+            player.danger = &danger;
+            scores[i] = player.play_game(catalog, game_rng::splitmix64(seed), max_moves);
+        });
+
+        for (size_t c = 0 ; c < population.size() ; c++){
+            uint64_t total = 0;
+            for (unsigned g = 0 ; g < games ; g++){
+                total += scores[c * games + g];
+            }
+            population[c].fitness = (double)total / games;
+        }
+        std::stable_sort(population.begin(), population.end(), [](const tuner_candidate& a, const tuner_candidate& b){
+            return a.fitness > b.fitness;
+        });
+    }
+
+    // Replaces the population with the elite and children of tournament
+    // winners (blend crossover, then mutation). Call after evaluate().
+    void breed(){
+        std::vector<tuner_candidate> next(population.begin(), population.begin() + std::min<size_t>(elite, population.size()));
+        while (next.size() < population.size()){
+            const tuner_candidate& a = tournament();
+            const tuner_candidate& b = tournament();
+            tuner_candidate child;
+            for (unsigned i = 0 ; i < FEATURE_COUNT ; i++){
+                double t = uniform() * 1.5 - 0.25;
+                child.weights[i] = (float)(a.weights[i] + t * (b.weights[i] - a.weights[i]));
+            }
+            if (risk){
+                double t = uniform() * 1.5 - 0.25;
+                child.risk_weight = (float)(a.risk_weight + t * (b.risk_weight - a.risk_weight));
+            }
+            mutate(child);
+            next.push_back(child);
+        }
+        population.swap(next);
+        generation++;
+    }
+
+    // Written to a temporary file and renamed, so a crash mid-write keeps
+    // the previous checkpoint.
+    bool save(const std::string& path) const {
+        std::string tmp_path = path + ".tmp";
+        std::ofstream file(tmp_path, std::ios::trunc);
+        if (!file.is_open()) return false;
+
+        file << "tuner 2\n";
+        file << "generation " << generation << "\n";
+        file << "rng " << rng.state[0] << " " << rng.state[1] << " " << rng.state[2] << " " << rng.state[3] << "\n";
+        file.precision(9);
+        for (const tuner_candidate& c : population){
+            file << "candidate " << c.fitness;
+            for (unsigned i = 0 ; i < FEATURE_COUNT ; i++){
+                file << " " << c.weights[i];
+            }
+            file << " " << c.risk_weight << "\n";
+        }
+        file.close();
+
+        return !file.fail() && rename(tmp_path.c_str(), path.c_str()) == 0;
+    }
+
+    // Returns false if there is no checkpoint; throws if it is unreadable.
+    // A checkpoint that evolved the risk weight goes on evolving it.
+    bool load(const std::string& path){
+        if (!read_checkpoint(path, generation, rng, population)) return false;
+        for (const tuner_candidate& c : population){
+            if (c.risk_weight != 0) risk = true;
+        }
+        return true;
+    }
+
+    // The parsing behind load(), for readers that only want the weights.
+    // Version 1 checkpoints have no risk weights; they read as 0.
+    static bool read_checkpoint(const std::string& path, unsigned& generation, game_rng& rng, std::vector<tuner_candidate>& population){
+        std::ifstream file(path);
+        if (!file.is_open()) return false;
+
+        std::string line, word;
+        unsigned version = 0;
+        std::vector<tuner_candidate> loaded;
+        while (std::getline(file, line)){
+            std::stringstream ss(line);
+            if (!(ss >> word)) continue;        // blank line
+            if (word == "tuner") ss >> version;
+            else if (word == "generation") ss >> generation;
+            else if (word == "rng") ss >> rng.state[0] >> rng.state[1] >> rng.state[2] >> rng.state[3];
+            else if (word == "candidate"){
+                tuner_candidate c;
+                ss >> c.fitness;
+                for (unsigned i = 0 ; i < FEATURE_COUNT ; i++){
+                    ss >> c.weights[i];
+                }
+                if (version >= 2) ss >> c.risk_weight;
+                loaded.push_back(c);
+            }
+            if (ss.fail()) throw std::runtime_error("Error: Bad line in tuner checkpoint " + path + ": " + line);
+        }
+
+        if (version < 1 || version > 2 || loaded.empty()){
+            throw std::runtime_error("Error: Not a tuner checkpoint: " + path);
+        }
+        population.swap(loaded);
+        return true;
+    }
+};
+
+
+// Copies the best weights of a tuner checkpoint into an evaluator: the
+// candidate with the highest fitness, which is the first of the elite kept
+// from the last generation. Returns false if there is no checkpoint; throws
+// if it is unreadable.
+inline bool load_tuned_weights(const std::string& path, risk_evaluator& evaluator){
+    unsigned generation = 0;
+    game_rng rng;
+    std::vector<tuner_candidate> population;
+    if (!weight_tuner::read_checkpoint(path, generation, rng, population)) return false;
+
+    const tuner_candidate* best = &population[0];
+    for (const tuner_candidate& c : population){
+        if (c.fitness > best->fitness) best = &c;
+    }
+    std::copy(best->weights, best->weights + FEATURE_COUNT, evaluator.linear.weights);
+    evaluator.risk_weight = best->risk_weight;
+    return true;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "Engine.cpp"
+#include "Catalog.cpp"
+
+
+// A whole position in 56 bytes: board, score, combo, hand and the generator
+// that deals the next hands. Copying one is all it takes to try a move and
+// take it back, so search code can make/unmake instead of copying a grid.
+struct game_position{
+    engine_state state;
+    game_hand hand;
+    game_rng rng;
+
+    void start(const piece_catalog& catalog, uint64_t seed){
+        state = engine_state();
+        rng.reseed(seed);
+        hand.draw(rng, catalog);
+    }
+
+    // Plays the piece in slot and deals a new hand after the last one.
+    // Returns false (leaving the position untouched) if it does not fit.
+    bool play(const piece_catalog& catalog, unsigned slot, unsigned row, unsigned col, cleared_lines* cleared = nullptr){
+        if (slot >= hand.count || !state.play(catalog.masks[hand.pieces[slot]], row, col, cleared)) return false;
+        hand.remove(slot);
+        if (hand.count == 0) hand.draw(rng, catalog);
+        return true;
+    }
+
+    // Plays a move and returns the position to unmake it with. The result
+    // equals *this when the move does not fit.
+    game_position make(const piece_catalog& catalog, unsigned slot, unsigned row, unsigned col){
+        game_position before = *this;
+        play(catalog, slot, row, col);
+        return before;
+    }
+
+    void unmake(const game_position& before){
+        *this = before;
+    }
+};
+static_assert(sizeof(game_position) == 56, "game_position layout changed");
+
+
+// Undo and redo over whole snapshots, each O(1): pushing drops anything
+// that could have been redone, undo and redo only move an index. Storage
+// grows with the number of moves and is reused after undoing.
+template <typename Snapshot>
+class undo_stack{
+private:
+    std::vector<Snapshot> snapshots;
+    size_t current = 0;
+
+public:
+    void reset(const Snapshot& start){
+        snapshots.clear();
+        snapshots.push_back(start);
+        current = 0;
+    }
+
+    void push(const Snapshot& s){
+        snapshots.resize(current + 1);
+        snapshots.push_back(s);
+        current++;
+    }
+
+    bool can_undo() const { return current > 0; }
+    bool can_redo() const { return current + 1 < snapshots.size(); }
+
+    const Snapshot& undo(){
+        if (can_undo()) current--;
+        return snapshots[current];
+    }
+
+    const Snapshot& redo(){
+        if (can_redo()) current++;
+        return snapshots[current];
+    }
+
+    const Snapshot& top() const { return snapshots[current]; }
+};
@@ -5,7 +5,25 @@
 #include <stdexcept>
 #include <fstream>
 #include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
 #include "libraries/Matrix.cpp"
+#include "libraries/Engine.cpp"
+#include "libraries/History.cpp"
+#include "libraries/Replay.cpp"
+#include "libraries/Player.cpp"
+#include "libraries/Protocol.cpp"
+#include "libraries/Server.cpp"
+#include "libraries/Profiler.cpp"
+#include "libraries/Search.cpp"
+#include "libraries/Danger.cpp"
+#include "libraries/Tuner.cpp"
+#include "libraries/Undo.cpp"
+#include "libraries/Save.cpp"
+#include "libraries/MatrixTest.cpp"
 
 using namespace std;
 
@@ -13,6 +31,8 @@ struct settings{
     string block_symbol = "@";
     string non_block_symbol = "`";
     size_t grid_space = 1;
+    bool record_replays = false;
+    bool risk_meter = false;
 };
 
 struct stats{
@@ -67,129 +87,7 @@ void display_score(size_t& score, size_t& high_score){
     cout << "Score: " << score << "                    High score: " << high_score << endl << endl;
 }
 
-vector<Matrix<bool>> define_shapes_vector(){
-    vector<Matrix<bool>> shapes;
-
-    Matrix<bool> shape(1, 3, true);
-    shapes.push_back(shape);
-    
-    shape.resize(1, 4);
-    shape.fill(true);
-    shapes.push_back(shape);
-    
-    shape.resize(1, 5);
-    shape.fill(true);
-    shapes.push_back(shape);
-    
-    shape.resize(2, 2);
-    shape.fill(true);
-    shapes.push_back(shape);
-    
-    shape.resize(2, 3);
-    shape.fill(true);
-    shapes.push_back(shape);
-    
-    shape.resize(3, 3);
-    shape.fill(true);
-    shapes.push_back(shape);
-    
-    shape.resize(2, 2);
-    shape.fill(true);
-    shape[0][1] = false;
-    shapes.push_back(shape);
-    
-    shape.resize(2, 3);
-    shape.fill(true);
-    shape[0][0] = false;
-    shape[0][2] = false;
-    shapes.push_back(shape);
-    
-    shape.resize(2, 3);
-    shape.fill(true);
-    shape[0][0] = false;
-    shape[0][1] = false;
-    shapes.push_back(shape);
-    
-    shape.resize(2, 3);
-    shape.fill(true);
-    shape[0][1] = false;
-    shape[0][2] = false;
-    shapes.push_back(shape);
-    
-    shape.resize(3, 3);
-    shape.fill(true);
-    shape[0][1] = false;
-    shape[0][2] = false;
-    shape[1][1] = false;
-    shape[1][2] = false;
-    shapes.push_back(shape);
-    
-    shape.resize(2, 2);
-    shape.fill(true);
-    shape[0][1] = false;
-    shape[1][0] = false;
-    shapes.push_back(shape);
-    
-    shape.resize(3, 3);
-    shape.fill(false);
-    shape[0][0] = true;
-    shape[1][1] = true;
-    shape[2][2] = true;
-    shapes.push_back(shape);
-    
-    shape.resize(2, 3);
-    shape.fill(true);
-    shape[0][0] = false;
-    shape[1][2] = false;
-    shapes.push_back(shape);
-    
-    shape.resize(2, 3);
-    shape.fill(true);
-    shape[0][2] = false;
-    shape[1][0] = false;
-    shapes.push_back(shape);
-    
-    return shapes;
-}
-
-Matrix<bool> rotate_shape(Matrix<bool>& shape, int angle){
-    angle %= 360;
-    if (angle < 0) angle += 360;
-    angle /= 90;
-
-    int rows = shape.get_rows();
-    int cols = shape.get_cols();
-
-    Matrix<bool> rotated_shape = shape;
-
-    if (angle == 1){
-        rotated_shape.resize(shape.get_cols(), shape.get_rows());
-        for (size_t i = 0; i < rotated_shape.get_rows(); i++){
-            for (size_t j = 0; j < rotated_shape.get_cols(); j++){
-                rotated_shape[i][j] = shape[rows-j-1][i];
-            }
-        }
-    }
-    else if (angle == 2){
-        for (size_t i = 0; i < rotated_shape.get_rows(); i++){
-            for (size_t j = 0; j < rotated_shape.get_cols(); j++){
-                rotated_shape[i][j] = shape[rows-i-1][cols-j-1];
-            }
-        }
-    }
-    else if (angle == 3){
-        rotated_shape.resize(shape.get_cols(), shape.get_rows());
-        for (size_t i = 0; i < rotated_shape.get_rows(); i++){
-            for (size_t j = 0; j < rotated_shape.get_cols(); j++){
-                rotated_shape[i][j] = shape[j][cols-i-1];
-            }
-        }
-    }
-
-    return rotated_shape;
-}
-
-bool place_piece(Matrix<bool>& Grid, Matrix<bool>& shape, size_t row, size_t col){
+bool place_piece(Matrix<bool>& Grid, const Matrix<bool>& shape, size_t row, size_t col){
     if ((row + shape.get_rows() > Grid.get_rows()) || (col + shape.get_cols() > Grid.get_cols())) return false;
 
     for (size_t i = row; i < shape.get_rows()+row; i++){
@@ -208,64 +106,35 @@ bool place_piece(Matrix<bool>& Grid, Matrix<bool>& shape, size_t row, size_t col
 }
 
 vector<size_t> clear_lines(Matrix<bool>& Grid){  //Returns number of rows and cols cleared
-    vector<size_t> rows_cols_cleared;
-    rows_cols_cleared.push_back(0);
-    rows_cols_cleared.push_back(0);
-
-    vector<size_t> rows_to_remove;
-    vector<size_t> cols_to_remove;
+    Matrix<bool> full_rows = Grid.row_all();
+    Matrix<bool> full_cols = Grid.col_all();
 
     for (size_t i = 0; i < Grid.get_rows(); i++){
-        bool isFilled = true;
+        if (!full_rows(i, 0)) continue;
         for (size_t j = 0; j < Grid.get_cols(); j++){
-            if (!Grid[i][j]){
-                isFilled = false;
-                break;
-            }
-        }
-        if (isFilled){
-            rows_to_remove.push_back(i);
-            rows_cols_cleared[0]++;
+            Grid[i][j] = false;
         }
     }
 
     for (size_t i = 0; i < Grid.get_cols(); i++){
-        bool isFilled = true;
-        for (size_t j = 0; j < Grid.get_rows(); j++){
-            if (!Grid[j][i]){
-                isFilled = false;
-                break;
-            }
-        }
-        if (isFilled){
-            cols_to_remove.push_back(i);
-            rows_cols_cleared[1]++;
-        }
-    }
-
-    for (size_t i = 0; i < rows_to_remove.size(); i++){
-        for (size_t j = 0; j < Grid.get_cols(); j++){
-            Grid[rows_to_remove[i]][j] = false;
-        }
-    }
-
-    for (size_t i = 0; i < cols_to_remove.size(); i++){
+        if (!full_cols(0, i)) continue;
         for (size_t j = 0; j < Grid.get_rows(); j++){
-            Grid[j][cols_to_remove[i]] = false;
+            Grid[j][i] = false;
         }
     }
 
-    return rows_cols_cleared;
+    return {full_rows.count(), full_cols.count()};
 }
 
-bool is_playable(Matrix<bool>& Grid, vector<Matrix<bool>>& shapes){
-    for (size_t i = 0; i < shapes.size(); i++){
-        for (size_t j = 0; j <= Grid.get_rows()-shapes[i].get_rows(); j++){
-            for (size_t k = 0; k <= Grid.get_cols()-shapes[i].get_cols(); k++){
+bool is_playable(Matrix<bool>& Grid, const game_hand& hand, const piece_catalog& catalog){
+    for (size_t i = 0; i < hand.count; i++){
+        const Matrix<bool>& shape = catalog.shapes[hand.pieces[i]];
+        for (size_t j = 0; j <= Grid.get_rows()-shape.get_rows(); j++){
+            for (size_t k = 0; k <= Grid.get_cols()-shape.get_cols(); k++){
                 bool can_be_placed = true;
-                for (size_t l = 0; l < shapes[i].get_rows(); l++){
-                    for (size_t m = 0; m < shapes[i].get_cols(); m++){
-                        if (Grid[l+j][m+k] && shapes[i][l][m]){
+                for (size_t l = 0; l < shape.get_rows(); l++){
+                    for (size_t m = 0; m < shape.get_cols(); m++){
+                        if (Grid[l+j][m+k] && shape[l][m]){
                             can_be_placed = false;
                             break;
                         }
@@ -280,33 +149,34 @@ bool is_playable(Matrix<bool>& Grid, vector<Matrix<bool>>& shapes){
     return false;
 }
 
-vector<Matrix<bool>> get_random_shapes(vector<Matrix<bool>> shapes, size_t no_of_shapes = 3){
-    vector<Matrix<bool>> random_shapes;
-    
-    size_t min = 0;
-    size_t max = shapes.size()-1;
-
-    for (size_t i = 0; i < no_of_shapes; i++){
-        Matrix<bool> shape = shapes[Matrix<size_t>::generate_random_number(min, max)];
-        shape = rotate_shape(shape, Matrix<size_t>::generate_random_number(0, 3) * 90);
-        random_shapes.push_back(shape);
-    }
-
-    return random_shapes;
+// The pieces every game draws from: the shape file given with --shapes, else
+// "game data/shapes.txt" if there is one, else the built-in shapes, all
+// equally likely. Built on first use.
+const string SHAPES_FILE = "game data/shapes.txt";
+string shape_file_path;
+
+const piece_catalog& get_piece_catalog(){
+    static piece_catalog catalog = [](){
+        if (shape_file_path.empty() && filesystem::exists(SHAPES_FILE)) shape_file_path = SHAPES_FILE;
+        if (!shape_file_path.empty()) return load_shape_file(shape_file_path);
+        return built_in_catalog();
+    }();
+    return catalog;
 }
 
-void display_shapes(vector<Matrix<bool>>& shapes){
+void display_shapes(const game_hand& hand, const piece_catalog& catalog){
     size_t max_height = 0;
-    for (size_t i = 0 ; i < shapes.size(); i++){
-        if (shapes[i].get_rows() > max_height) max_height = shapes[i].get_rows();
+    for (size_t i = 0 ; i < hand.count; i++){
+        if (catalog.shapes[hand.pieces[i]].get_rows() > max_height) max_height = catalog.shapes[hand.pieces[i]].get_rows();
     }
 
     for (size_t i = 0; i < max_height; i++){
-        for (size_t j = 0; j < shapes.size(); j++){
+        for (size_t j = 0; j < hand.count; j++){
+            const Matrix<bool>& shape = catalog.shapes[hand.pieces[j]];
             cout << " ";
             for (size_t k = 0; k < 5; k++){
-                if ((i < shapes[j].get_rows()) && (k < shapes[j].get_cols())){
-                    if (shapes[j][i][k]) cout << "* ";
+                if ((i < shape.get_rows()) && (k < shape.get_cols())){
+                    if (shape[i][k]) cout << "* ";
                     else cout << "  ";
                 }
                 else{
@@ -318,7 +188,7 @@ void display_shapes(vector<Matrix<bool>>& shapes){
         cout << endl;
     }
     cout << "      ";
-    for (size_t i = 1; i <= shapes.size(); i++){
+    for (size_t i = 1; i <= hand.count; i++){
         cout << i << "          ";
     }
     cout << endl << endl;
@@ -334,6 +204,8 @@ void save_setings(settings s){
     file << s.block_symbol + ",";
     file << s.non_block_symbol + ",";
     file << to_string(s.grid_space) + ",";
+    file << to_string(s.record_replays) + ",";
+    file << to_string(s.risk_meter) + ",";
 
     file.close();
 
@@ -348,15 +220,19 @@ settings load_settings(){
 
     if (getline(file, line)){
         stringstream ss(line);
-        string col1, col2, col3;
+        string col1, col2, col3, col4, col5;
 
         getline(ss, col1, ',');
         getline(ss, col2, ',');
         getline(ss, col3, ',');
+        getline(ss, col4, ',');
+        getline(ss, col5, ',');
 
         s.block_symbol = col1;
         s.non_block_symbol = col2;
         s.grid_space = stoi(col3);
+        if (!col4.empty()) s.record_replays = stoi(col4);
+        if (!col5.empty()) s.risk_meter = stoi(col5);
     }
 
     file.close();
@@ -372,8 +248,10 @@ void show_settings(){
         cout << "1.Block symbol: " + s.block_symbol << endl;
         cout << "2.Non block symbol: " + s.non_block_symbol << endl;
         cout << "3.Grid space: " + to_string(s.grid_space) << endl;
-        cout << "4.Reset to default" << endl;
-        cout << "5.Back(save settings)" << endl;
+        cout << "4.Record replays: " << (s.record_replays ? "on" : "off") << endl;
+        cout << "5.Risk meter: " << (s.risk_meter ? "on" : "off") << endl;
+        cout << "6.Reset to default" << endl;
+        cout << "7.Back(save settings)" << endl;
         cout << "Enter input: ";
 
         cin >> user_input;
@@ -434,13 +312,21 @@ void show_settings(){
             }
         }
         else if (user_input == "4"){
+            s.record_replays = !s.record_replays;
+        }
+        else if (user_input == "5"){
+            s.risk_meter = !s.risk_meter;
+        }
+        else if (user_input == "6"){
             settings default_settings;
             default_settings.block_symbol = "@";
             default_settings.non_block_symbol = "`";
             default_settings.grid_space = 1;
+            default_settings.record_replays = false;
+            default_settings.risk_meter = false;
             s = default_settings;
         }
-        else if (user_input == "5"){
+        else if (user_input == "7"){
             save_setings(s);
             break;
         }
@@ -450,47 +336,266 @@ void show_settings(){
     }
 }
 
-void save_stats(stats s){
-    ofstream file("game data/stats.csv");
-    if (!file.is_open()){
+const string STATS_FILE = "game data/stats.csv";
+const string STATS_JOURNAL_FILE = "game data/stats.journal";
+const size_t STATS_JOURNAL_BATCH = 64;          // games buffered in memory before one append
+const size_t STATS_COMPACT_THRESHOLD = 4096;    // journal entries folded back into stats.csv
+const string HISTORY_FILE = "game data/history.bin";
+const string HISTORY_SUMMARY_FILE = "game data/history.idx";
+const string REPLAY_DIRECTORY = "game data/replays";
+const string TUNER_CHECKPOINT_FILE = "game data/tuner.checkpoint";
+const string SAVED_GAME_FILE = "game data/saved_game.bin";
+
+// The journal starts with a "#G" line naming its generation, and stats.csv
+// records the last generation it absorbed. Compaction writes stats.csv
+// first and only then starts a journal of the next generation, so after a
+// crash in between, the old journal is recognized as counted and ignored.
+struct stats_store{
+    stats cache;
+    string pending;                 // journal lines not yet appended
+    size_t pending_games = 0;
+    size_t journal_games = 0;       // entries already on disk in the journal
+    size_t generation = 1;          // of the current journal
+    bool loaded = false;
+};
+
+stats_store& get_stats_store(){
+    static stats_store store;
+    return store;
+}
+
+size_t journal_checksum(size_t score, size_t shapes){
+    return (score * 1000003u) ^ (shapes * 2654435761u) ^ 0x5bd1e995u;
+}
+
+void fold_game(stats& s, size_t score, size_t shapes){
+    s.games_played++;
+    s.shapes_placed += shapes;
+    if (score > s.high_score) s.high_score = score;
+    s.avg_score += (score - s.avg_score) / s.games_played;
+}
+
+// Writes the snapshot to a temporary file, syncs it and renames it over
+// stats.csv, so a reader never sees a half written file, then replaces the
+// journal it absorbed with an empty one of the next generation. The
+// directory is synced too, or the rename itself could be lost in a crash
+// after the new journal reached the disk.
+void compact_stats(){
+    stats_store& store = get_stats_store();
+    stats& s = store.cache;
+
+    string tmp_path = STATS_FILE + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "w");
+    if (!file){
         std::cerr << "failed to open file for writing.\n";
         return;
     }
 
-    file << to_string(s.high_score) + ",";
-    file << to_string(s.avg_score) + ",";
-    file << to_string(s.games_played) + ",";
-    file << to_string(s.shapes_placed) + ",";
+    string line = to_string(s.high_score) + "," + to_string(s.avg_score) + "," + to_string(s.games_played) + ","
+                + to_string(s.shapes_placed) + "," + to_string(store.generation) + ",";
+    bool ok = fputs(line.c_str(), file) >= 0 && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
 
-    file.close();
+    if (!ok || rename(tmp_path.c_str(), STATS_FILE.c_str()) != 0){
+        std::cerr << "failed to replace stats file.\n";
+        return;
+    }
 
-    return;
+    string directory = STATS_FILE.substr(0, STATS_FILE.rfind('/'));
+    int directory_fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (directory_fd < 0 || fsync(directory_fd) != 0) std::cerr << "failed to sync stats directory.\n";
+    if (directory_fd >= 0) close(directory_fd);
+
+    store.generation++;
+    ofstream journal(STATS_JOURNAL_FILE, ios::trunc);
+    journal << "#" << store.generation << "\n";
+    store.journal_games = 0;
 }
 
-stats load_stats(){
-    stats s;
+void flush_stats_journal(){
+    stats_store& store = get_stats_store();
+    if (store.pending_games == 0) return;
 
-    ifstream file("game data/stats.csv");
+    ofstream journal(STATS_JOURNAL_FILE, ios::app);
+    if (!journal.is_open()){
+        std::cerr << "failed to open file for writing.\n";
+        return;
+    }
+    journal.write(store.pending.data(), store.pending.size());
+    journal.close();
+
+    store.journal_games += store.pending_games;
+    store.pending.clear();
+    store.pending_games = 0;
+
+    if (store.journal_games >= STATS_COMPACT_THRESHOLD) compact_stats();
+}
+
+void load_stats_cache(){
+    stats_store& store = get_stats_store();
+    stats& s = store.cache;
+
+    ifstream file(STATS_FILE);
     string line;
+    size_t absorbed = 0;            // journal generation already in the totals
 
     if (getline(file, line)){
         stringstream ss(line);
-        string col1, col2, col3, col4;
+        string col1, col2, col3, col4, col5;
 
         getline(ss, col1, ',');
         getline(ss, col2, ',');
         getline(ss, col3, ',');
         getline(ss, col4, ',');
+        getline(ss, col5, ',');
 
-        s.high_score = stoi(col1);
+        s.high_score = stoull(col1);
         s.avg_score = stod(col2);
-        s.games_played = stoi(col3);
-        s.shapes_placed = stoi(col4);
+        s.games_played = stoull(col3);
+        s.shapes_placed = stoull(col4);
+        if (!col5.empty()) absorbed = stoull(col5);
     }
-
     file.close();
 
-    return s;
+    // Replay the games appended since the last compaction. A line without its
+    // newline or with a bad checksum is the tail of an interrupted append. A
+    // journal whose generation stats.csv already absorbed is skipped; one
+    // without a generation line predates them and is folded in.
+    ifstream journal(STATS_JOURNAL_FILE, ios::binary);
+    string contents((istreambuf_iterator<char>(journal)), istreambuf_iterator<char>());
+    bool torn = false;
+    bool stale = contents.empty();  // so that it gets a generation line
+    bool legacy = false;
+    size_t start = 0;
+
+    store.generation = absorbed + 1;
+    size_t generation;
+    if (sscanf(contents.c_str(), "#%zu\n", &generation) == 1 && contents.find('\n') != string::npos){
+        start = contents.find('\n') + 1;
+        if (generation <= absorbed) stale = true;
+        else store.generation = generation;
+    }
+    else if (!stale){
+        legacy = true;
+    }
+
+    while (!stale && start < contents.size()){
+        size_t end = contents.find('\n', start);
+        if (end == string::npos){
+            torn = true;
+            break;
+        }
+
+        size_t score, shapes, check;
+        if (sscanf(contents.c_str() + start, "%zu,%zu,%zu", &score, &shapes, &check) == 3 && check == journal_checksum(score, shapes)){
+            fold_game(s, score, shapes);
+            store.journal_games++;
+        }
+        else{
+            torn = true;
+        }
+        start = end + 1;
+    }
+
+    store.loaded = true;
+
+    // New appends must not land after a torn line or in a journal that is
+    // already counted, so start from a clean journal.
+    if (stale){
+        store.generation = absorbed + 1;
+        ofstream fresh(STATS_JOURNAL_FILE, ios::trunc);
+        fresh << "#" << store.generation << "\n";
+    }
+    else if (torn || store.journal_games >= STATS_COMPACT_THRESHOLD || legacy){
+        compact_stats();
+    }
+}
+
+void record_game_stats(size_t score, size_t shapes){
+    stats_store& store = get_stats_store();
+    if (!store.loaded) load_stats_cache();
+
+    fold_game(store.cache, score, shapes);
+
+    store.pending += to_string(score) + "," + to_string(shapes) + "," + to_string(journal_checksum(score, shapes)) + "\n";
+    store.pending_games++;
+
+    if (store.pending_games >= STATS_JOURNAL_BATCH) flush_stats_journal();
+}
+
+void save_stats(stats s){
+    stats_store& store = get_stats_store();
+    if (!store.loaded) load_stats_cache();     // for the journal's generation
+
+    store.cache = s;
+    store.pending.clear();
+    store.pending_games = 0;
+    store.loaded = true;
+    compact_stats();
+}
+
+history_writer& get_history_writer(){
+    static history_writer writer(HISTORY_FILE);
+    return writer;
+}
+
+void flush_game_data(){
+    flush_stats_journal();
+    get_history_writer().flush();
+}
+
+stats load_stats(){
+    stats_store& store = get_stats_store();
+    if (!store.loaded) load_stats_cache();
+
+    return store.cache;
+}
+
+void show_history(){
+    get_history_writer().open();
+    get_history_writer().flush();
+    history_summary h = load_history_summary(HISTORY_FILE, HISTORY_SUMMARY_FILE);
+
+    if (h.games == 0){
+        cout << "No games recorded yet." << endl << endl;
+        return;
+    }
+
+    cout << "Games recorded: " + to_string(h.games) << endl;
+    cout << "Mean score: " + to_string(h.mean_score()) << endl;
+    cout << "Median score (p50): " + to_string(h.percentile(0.50)) << endl;
+    cout << "p90 score: " + to_string(h.percentile(0.90)) << endl;
+    cout << "p99 score: " + to_string(h.percentile(0.99)) << endl;
+    cout << "Best combo: " + to_string(h.max_combo) << endl;
+    cout << "Lines per game: " + to_string((double)h.total_lines / h.games) << endl;
+    cout << "Moves per game: " + to_string((double)h.total_moves / h.games) << endl;
+    cout << endl;
+
+    // Bars are built from the summary's buckets, each counted in the bar its
+    // lower bound falls in, so above 64 a bar's edges are approximate.
+    const size_t bars = 10;
+    const size_t bar_width = 40;
+    uint32_t step = h.max_score / bars + 1;
+    vector<uint64_t> counts(bars);
+    uint64_t largest = 1;
+    for (size_t i = 0; i < bars; i++){
+        counts[i] = h.count_between(i * step, (i + 1) * step);
+        if (counts[i] > largest) largest = counts[i];
+    }
+    for (size_t i = 0; i < bars; i++){
+        string range = to_string(i * step) + "-" + to_string((i + 1) * step - 1);
+        cout << range << string(range.size() < 12 ? 12 - range.size() : 1, ' ');
+        cout << string(counts[i] * bar_width / largest, '#') << " " << counts[i] << endl;
+    }
+    cout << endl;
+
+    history_view view(HISTORY_FILE);
+    size_t recent = view.size() < 100 ? view.size() : 100;
+    uint64_t recent_total = 0;
+    for (size_t i = view.size() - recent; i < view.size(); i++){
+        recent_total += view[i].score;
+    }
+    cout << "Mean of last " + to_string(recent) + " games: " + to_string((double)recent_total / recent) << endl << endl;
 }
 
 void show_stats(){
@@ -506,7 +611,8 @@ void show_stats(){
 
     while(true){
         cout << "1.Reset stats" << endl;
-        cout << "2.Back" << endl;
+        cout << "2.Score distribution" << endl;
+        cout << "3.Back" << endl;
         cout << "Enter input: ";
 
         cin >> user_input;
@@ -526,6 +632,8 @@ void show_stats(){
                     default_stats.games_played = 0;
                     default_stats.shapes_placed = 0;
                     save_stats(default_stats);
+                    remove(HISTORY_FILE.c_str());
+                    remove(HISTORY_SUMMARY_FILE.c_str());
                     break;
                 }
                 else if(confirm == "N" || confirm == "n"){
@@ -539,6 +647,14 @@ void show_stats(){
             break;
         }
         else if (user_input == "2"){
+            // A damaged or foreign history file must not end the game.
+            try {
+                show_history();
+            } catch (const std::exception& e) {
+                cout << e.what() << endl << endl;
+            }
+        }
+        else if (user_input == "3"){
             break;
         }
         else{
@@ -549,83 +665,233 @@ void show_stats(){
 
 
 
-void run_game(){
-    settings sett = load_settings();
-    stats stat = load_stats();
+// What undo and redo restore in run_game: the position (which includes the
+// generator, so undoing can't deal different hands) and the game's tallies.
+struct turn_snapshot{
+    game_position position;
+    uint32_t shapes_placed = 0;
+    uint32_t lines_cleared = 0;
+    uint32_t max_combo = 0;
+};
+
+// Starts a new game, or continues a saved one with the settings it was
+// saved with.
+void run_game(const saved_game* resume = nullptr){
+    settings sett;
+    stats stat;
+    game_profiler::reset();     // the summary at game over covers this game only
+    {
+        scoped_timer timer(PHASE_STATS_IO);
+        sett = load_settings();
+        stat = load_stats();
+    }
+    if (resume){
+        sett.block_symbol = resume->block_symbol;
+        sett.non_block_symbol = resume->non_block_symbol;
+        sett.grid_space = resume->grid_space;
+        sett.risk_meter = resume->risk_meter;
+        // The moves before the save are not kept, so there is nothing to replay.
+        sett.record_replays = false;
+    }
 
     Matrix<bool> Grid(8, 8, false);
-    vector<Matrix<bool>> shapes = define_shapes_vector();
     size_t score = 0;
     size_t combo = 0;
+    size_t shapes_placed = 0;
+    size_t lines_cleared = 0;
+    size_t max_combo = 0;
+
+    uint64_t seed = resume ? resume->seed : game_rng::make_seed();
+    game_rng rng(seed);
+    auto start_time = chrono::steady_clock::now() - chrono::milliseconds(resume ? resume->elapsed_ms : 0);
+
+    const piece_catalog& catalog = get_piece_catalog();
+    unique_ptr<thread_pool> pool;
+    unique_ptr<danger_analyzer> danger;
+    if (sett.risk_meter){
+        pool = make_unique<thread_pool>();
+        danger = make_unique<danger_analyzer>(catalog.masks, *pool);
+        danger->set_weights(catalog.probabilities);
+    }
 
-    vector<Matrix<bool>> options;
-    options = get_random_shapes(shapes, 3);
+    replay rec;
+    rec.header.seed = seed;
+    rec.header.shape_count = catalog.shape_count;
+    rec.header.shape_set = catalog.fingerprint;
+
+#ifdef MATRIX_TRACK_ALLOCATIONS
+    matrix_counters game_allocations = Matrix<bool>::counters();
+#endif
+
+    game_hand hand;
+    if (resume){
+        game_position position = resume->position();
+        board_to_matrix(position.state.board, Grid);
+        score = position.state.score;
+        combo = position.state.combo;
+        hand = position.hand;
+        rng = position.rng;
+        shapes_placed = resume->shapes_placed;
+        lines_cleared = resume->lines_cleared;
+        max_combo = resume->max_combo;
+    }
+    else{
+        scoped_timer timer(PHASE_DRAW);
+        hand.draw(rng, catalog);
+    }
+
+    undo_stack<turn_snapshot> history;
+    auto take_snapshot = [&](){
+        turn_snapshot t;
+        t.position.state.board = board_from_matrix(Grid);
+        t.position.state.score = score;
+        t.position.state.combo = combo;
+        t.position.hand = hand;
+        t.position.rng = rng;
+        t.shapes_placed = shapes_placed;
+        t.lines_cleared = lines_cleared;
+        t.max_combo = max_combo;
+        return t;
+    };
+    auto restore_snapshot = [&](const turn_snapshot& t){
+        board_to_matrix(t.position.state.board, Grid);
+        score = t.position.state.score;
+        combo = t.position.state.combo;
+        hand = t.position.hand;
+        rng = t.position.rng;
+        shapes_placed = t.shapes_placed;
+        lines_cleared = t.lines_cleared;
+        max_combo = t.max_combo;
+    };
+    history.reset(take_snapshot());
 
     while (true){
-        cout << endl;
-        display_grid(Grid, sett.grid_space, sett.block_symbol, sett.non_block_symbol);
-        display_score(score, stat.high_score);
-        display_shapes(options);
-        
-        size_t shape_no;
-        while(true){
-            cout << "Choose a shape: ";
-            cin >> shape_no;
-            if (cin.fail() || shape_no > options.size() || shape_no == 0) {
-                cin.clear();
-                cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                cout << "Enter a valid input!" << endl;
-            } else {
-                break;
+        game_profiler::poll(cout);
+#ifdef MATRIX_TRACK_ALLOCATIONS
+        matrix_counters move_allocations = Matrix<bool>::counters();
+#endif
+        {
+            scoped_timer timer(PHASE_RENDER);
+            cout << endl;
+            display_grid(Grid, sett.grid_space, sett.block_symbol, sett.non_block_symbol);
+            display_score(score, stat.high_score);
+            if (danger){
+                danger_report report = danger->analyze(board_from_matrix(Grid));
+                cout << "Risk: " << fixed << setprecision(1) << report.dies_in_hand * 100 << "% of next hands can't be placed" << defaultfloat << endl << endl;
             }
+            display_shapes(hand, catalog);
         }
         
-        size_t row_no;
-        while(true){
-            cout << "Choose a row: ";
-            cin >> row_no;
-            if (cin.fail() || row_no > Grid.get_rows() || row_no == 0) {
-                cin.clear();
-                cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                cout << "Enter a valid input!" << endl;
-            } else {
-                break;
+        size_t shape_no = 0, row_no, col_no;
+        string choice;
+        {
+            scoped_timer timer(PHASE_INPUT);
+            while(true){
+                cout << "Choose a shape (u: undo, r: redo, s: save and quit): ";
+                cin >> choice;
+                if (!cin.fail() && (choice == "u" || choice == "r" || choice == "s")) break;
+                if (!cin.fail() && choice.find_first_not_of("0123456789") == string::npos && choice.size() < 3) shape_no = stoul(choice);
+                if (cin.fail() || shape_no > hand.count || shape_no == 0) {
+                    cin.clear();
+                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    cout << "Enter a valid input!" << endl;
+                } else {
+                    break;
+                }
             }
         }
+
+        if (choice == "s"){
+            saved_game save;
+            save.shape_count = catalog.shape_count;
+            save.shape_set = catalog.fingerprint;
+            save.seed = seed;
+            save.set_position(take_snapshot().position);
+            save.shapes_placed = shapes_placed;
+            save.lines_cleared = lines_cleared;
+            save.max_combo = max_combo;
+            save.elapsed_ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time).count();
+            save.grid_space = sett.grid_space;
+            save.record_replays = sett.record_replays;
+            save.risk_meter = sett.risk_meter;
+            saved_game::set_symbol(save.block_symbol, sett.block_symbol);
+            saved_game::set_symbol(save.non_block_symbol, sett.non_block_symbol);
+
+            if (save_game_file(SAVED_GAME_FILE, save)){
+                cout << "Game saved." << endl << endl;
+                return;
+            }
+            std::cerr << "failed to save the game.\n";
+            continue;
+        }
+
+        if (choice == "u" || choice == "r"){
+            bool can = choice == "u" ? history.can_undo() : history.can_redo();
+            if (!can) cout << "Nothing to " << (choice == "u" ? "undo" : "redo") << "!" << endl;
+            else restore_snapshot(choice == "u" ? history.undo() : history.redo());
+            continue;
+        }
+
+        {
+            scoped_timer timer(PHASE_INPUT);
         
-        size_t col_no;
-        while(true){
-            cout << "Choose a column: ";
-            cin >> col_no;
-            if (cin.fail() || col_no > Grid.get_cols() || col_no == 0) {
-                cin.clear();
-                cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                cout << "Enter a valid input!" << endl;
-            } else {
-                break;
+            while(true){
+                cout << "Choose a row: ";
+                cin >> row_no;
+                if (cin.fail() || row_no > Grid.get_rows() || row_no == 0) {
+                    cin.clear();
+                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    cout << "Enter a valid input!" << endl;
+                } else {
+                    break;
+                }
+            }
+        
+            while(true){
+                cout << "Choose a column: ";
+                cin >> col_no;
+                if (cin.fail() || col_no > Grid.get_cols() || col_no == 0) {
+                    cin.clear();
+                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    cout << "Enter a valid input!" << endl;
+                } else {
+                    break;
+                }
             }
         }
         
-        if (!place_piece(Grid, options[shape_no-1], row_no-1, col_no-1)){
+        uint8_t piece = hand.pieces[shape_no-1];
+        const Matrix<bool>& shape = catalog.shapes[piece];
+        bool placed;
+        {
+            scoped_timer timer(PHASE_PLACE);
+            placed = place_piece(Grid, shape, row_no-1, col_no-1);
+        }
+        if (!placed){
             cout << "Invalid move!" << endl;
             continue;
         }
 
-        stat.shapes_placed++;
-        
-        for (size_t i = 0; i < options[shape_no-1].get_rows(); i++){
-            for (size_t j = 0; j < options[shape_no-1].get_cols(); j++){
-                if (options[shape_no-1][i][j]) score++;
-            }
+        shapes_placed++;
+        if (sett.record_replays){
+            rec.moves.resize(shapes_placed - 1);
+            rec.record(shape_no-1, catalog.shape_of[piece], catalog.rotation_of[piece], row_no-1, col_no-1);
         }
         
-        options.erase(options.begin() + shape_no-1);
+        score += catalog.masks[piece].cells;
         
-        if (options.size() == 0){
-            options = get_random_shapes(shapes, 3);
+        hand.remove(shape_no-1);
+        
+        if (hand.count == 0){
+            scoped_timer timer(PHASE_DRAW);
+            hand.draw(rng, catalog);
         }
         
-        vector<size_t> rows_cols_cleared = clear_lines(Grid);
+        vector<size_t> rows_cols_cleared;
+        {
+            scoped_timer timer(PHASE_CLEAR);
+            rows_cols_cleared = clear_lines(Grid);
+        }
         
         size_t points = 0;
         points += Grid.get_rows() * rows_cols_cleared[0];
@@ -636,17 +902,55 @@ void run_game(){
         else combo = 0;
         
         score += combo * points;
+        lines_cleared += rows_cols_cleared[0] + rows_cols_cleared[1];
+        if (combo > max_combo) max_combo = combo;
         
-        if (!is_playable(Grid, options)){
+        history.push(take_snapshot());
+
+        bool playable;
+        {
+            scoped_timer timer(PHASE_PLAYABLE);
+            playable = is_playable(Grid, hand, catalog);
+        }
+
+#ifdef MATRIX_TRACK_ALLOCATIONS
+        cout << "Matrix<bool> this move: " << Matrix<bool>::counters() - move_allocations << endl;
+#endif
+
+        if (!playable){
             display_grid(Grid, sett.grid_space);
             display_score(score, stat.high_score);
-            display_shapes(options);
+            display_shapes(hand, catalog);
             cout << "Game Over!" << endl;
-            stat.games_played++;
-            if (score > stat.high_score) stat.high_score = score;
-            stat.avg_score = stat.avg_score + (score + stat.avg_score) / (stat.games_played);
 
-            save_stats(stat);
+            {
+                scoped_timer timer(PHASE_STATS_IO);
+                record_game_stats(score, shapes_placed);
+
+                game_record record;
+                record.seed = seed;
+                record.score = score;
+                record.moves = shapes_placed;
+                record.lines_cleared = lines_cleared;
+                record.max_combo = max_combo;
+                record.duration_ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time).count();
+                get_history_writer().append(record);
+                get_history_writer().flush();
+
+                if (sett.record_replays){
+                    rec.header.final_score = score;
+                    rec.moves.resize(shapes_placed);
+                    filesystem::create_directories(REPLAY_DIRECTORY);
+                    string path = REPLAY_DIRECTORY + "/" + to_string(seed) + ".tbr";
+                    if (rec.save(path)) cout << "Replay saved to " << path << endl;
+                    else std::cerr << "failed to open file for writing.\n";
+                }
+            }
+
+            if (game_profiler::enabled) game_profiler::dump(cout);
+#ifdef MATRIX_TRACK_ALLOCATIONS
+            cout << "Matrix<bool> this game: " << Matrix<bool>::counters() - game_allocations << endl;
+#endif
             break;
         }
     }
@@ -665,7 +969,29 @@ void run_application(){
 
         cout << endl << endl;
         if (user_input == "1"){
-            run_game();
+            saved_game save;
+            if (!load_game_file(SAVED_GAME_FILE, save)){
+                run_game();
+                continue;
+            }
+
+            string confirm;
+            while (true){
+                cout << "Resume saved game (y/n): ";
+                cin >> confirm;
+                if (confirm == "Y" || confirm == "y" || confirm == "N" || confirm == "n") break;
+                cout << "Invalid input!" << endl;
+            }
+            remove(SAVED_GAME_FILE.c_str());
+            cout << endl;
+
+            if ((confirm == "Y" || confirm == "y") && save.matches(get_piece_catalog())){
+                run_game(&save);
+            }
+            else{
+                if (confirm == "Y" || confirm == "y") cout << "The saved game used a different shape set or is damaged." << endl << endl;
+                run_game();
+            }
         }
         else if (user_input == "2"){
             show_settings();
@@ -682,8 +1008,594 @@ void run_application(){
     }
 }
 
-int main(){
+// Thread counts above this are taken for typing mistakes.
+const unsigned MAX_THREADS = 1024;
+
+// Reads the value of a numeric command line option: digits only, from low
+// to high. Otherwise prints why and returns false, and the command stops.
+template <typename T>
+bool parse_option(const string& name, const string& text, T& value, unsigned long long low = 0,
+                  unsigned long long high = numeric_limits<T>::max()){
+    bool valid = !text.empty() && text.find_first_not_of("0123456789") == string::npos;
+    unsigned long long parsed = 0;
+    if (valid){
+        try {
+            parsed = stoull(text);
+        } catch (const std::out_of_range&) {
+            valid = false;
+        }
+    }
+    if (!valid || parsed < low || parsed > high){
+        cerr << "Error: " << name << " must be a whole number";
+        if (high < numeric_limits<unsigned long long>::max()) cerr << " from " << low << " to " << high;
+        else if (low > 0) cerr << " from " << low << " up";
+        cerr << endl;
+        return false;
+    }
+    value = (T)parsed;
+    return true;
+}
+
+// Re-executes replays without rendering and checks their final scores.
+// With --repeat every replay is verified that many times, for timing.
+int run_replay_command(int argc, char* argv[]){
+    const piece_catalog& catalog = get_piece_catalog();
+
+    size_t repeat = 1;
+    vector<replay> replays;
+    vector<string> names;
+
+    for (int i = 0; i < argc; i++){
+        string arg = argv[i];
+        if (arg == "--repeat" && i + 1 < argc){
+            if (!parse_option(arg, argv[++i], repeat, 1)) return 1;
+            continue;
+        }
+        try {
+            replays.push_back(replay::load(arg));
+            names.push_back(arg);
+        } catch (const std::exception& e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
+    }
+
+    if (replays.empty()){
+        cerr << "usage: replay [--repeat N] <file>..." << endl;
+        return 1;
+    }
+
+    size_t failures = 0;
+    size_t total_moves = 0;
+    auto start = chrono::steady_clock::now();
+
+    for (size_t i = 0; i < replays.size(); i++){
+        replay_result result;
+        for (size_t k = 0; k < repeat; k++){
+            result = verify_replay(replays[i], catalog);
+            total_moves += result.moves_played;
+        }
+
+        if (result.ok){
+            cout << names[i] << ": OK, score " << result.score << ", " << result.moves_played << " moves" << endl;
+        }
+        else{
+            cout << names[i] << ": FAILED, " << result.error << endl;
+            failures++;
+        }
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << total_moves << " moves replayed in " << seconds << " s";
+    if (seconds > 0) cout << " (" << (size_t)(total_moves / seconds) << " moves/s)";
+    cout << endl;
+
+    return failures ? 1 : 0;
+}
+
+// perft on the reference rules: every placement is tried with place_piece on
+// a copy of the grid, then clear_lines, exactly like run_game.
+size_t perft_reference(Matrix<bool>& Grid, vector<Matrix<bool>>& hand, size_t depth){
+    if (depth == 0) return 1;
+
+    size_t nodes = 0;
+    for (size_t slot = 0; slot < hand.size(); slot++){
+        vector<Matrix<bool>> rest = hand;
+        rest.erase(rest.begin() + slot);
+
+        for (size_t row = 0; row < Grid.get_rows(); row++){
+            for (size_t col = 0; col < Grid.get_cols(); col++){
+                Matrix<bool> next = Grid;
+                if (!place_piece(next, hand[slot], row, col)) continue;
+                clear_lines(next);
+                nodes += perft_reference(next, rest, depth - 1);
+            }
+        }
+    }
+    return nodes;
+}
+
+// Counts placement sequences to a given depth, for checking and timing the
+// move generator. The hand is a list of catalog ids; without --hand a hand of
+// 3 is drawn from --seed.
+int run_perft_command(int argc, char* argv[]){
+    const piece_catalog& catalog = get_piece_catalog();
+
+    size_t depth = 3;
+    uint64_t board = 0;
+    uint64_t seed = 1;
+    vector<uint8_t> hand;
+    bool verify = false;
+    bool divide = false;
+
+    try {
+        for (int i = 0; i < argc; i++){
+            string arg = argv[i];
+            bool has_value = i + 1 < argc;
+            if (arg == "--board" && has_value) board = stoull(argv[++i], nullptr, 16);
+            else if (arg == "--seed" && has_value) seed = stoull(argv[++i]);
+            else if (arg == "--hand" && has_value){
+                stringstream ss(argv[++i]);
+                string id;
+                while (getline(ss, id, ',')){
+                    size_t piece = stoul(id);
+                    if (piece >= catalog.size()) throw runtime_error("piece id out of range: " + id);
+                    hand.push_back(piece);
+                }
+            }
+            else if (arg == "--verify") verify = true;
+            else if (arg == "--divide") divide = true;
+            else if (arg[0] != '-') depth = stoul(arg);
+            else throw runtime_error("unknown option " + arg);
+        }
+    } catch (const std::exception& e) {
+        cerr << e.what() << endl;
+        cerr << "usage: perft [depth] [--board HEX] [--hand ID,ID,...] [--seed S] [--divide] [--verify]" << endl;
+        return 1;
+    }
+
+    if (hand.empty()){
+        game_rng rng(seed);
+        game_hand drawn;
+        drawn.draw(rng, catalog);
+        hand.assign(drawn.pieces, drawn.pieces + drawn.count);
+    }
+    if (depth > hand.size()){
+        cerr << "depth can't exceed the hand size (" << hand.size() << ")" << endl;
+        return 1;
+    }
+
+    cout << "board " << hex << board << dec << ", hand";
+    for (size_t i = 0; i < hand.size(); i++) cout << " " << (int)hand[i];
+    cout << ", depth " << depth << endl;
+
+    if (divide && depth > 0){
+        for (size_t slot = 0; slot < hand.size(); slot++){
+            vector<uint8_t> rest = hand;
+            rest.erase(rest.begin() + slot);
+            const piece_mask& p = catalog.masks[hand[slot]];
+            for (uint64_t anchors = piece_placements(board, p); anchors; anchors &= anchors - 1){
+                unsigned anchor = __builtin_ctzll(anchors);
+                uint64_t next = board | (p.mask << anchor);
+                clear_full_lines(next);
+                cout << "  " << slot + 1 << " " << anchor / BOARD_SIZE + 1 << " " << anchor % BOARD_SIZE + 1 << ": "
+                     << perft(next, rest.data(), rest.size(), depth - 1, catalog.masks) << endl;
+            }
+        }
+    }
+
+    auto start = chrono::steady_clock::now();
+    uint64_t nodes = perft(board, hand.data(), hand.size(), depth, catalog.masks);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "nodes " << nodes << " in " << seconds << " s";
+    if (seconds > 0) cout << " (" << (uint64_t)(nodes / seconds) << " nodes/s)";
+    cout << endl;
+
+    if (verify){
+        Matrix<bool> Grid(BOARD_SIZE, BOARD_SIZE, false);
+        board_to_matrix(board, Grid);
+        vector<Matrix<bool>> matrix_hand;
+        for (size_t i = 0; i < hand.size(); i++){
+            matrix_hand.push_back(catalog.shapes[hand[i]]);
+        }
+
+        start = chrono::steady_clock::now();
+        size_t reference = perft_reference(Grid, matrix_hand, depth);
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        cout << "reference " << reference << " in " << seconds << " s: " << (reference == nodes ? "match" : "MISMATCH") << endl;
+        if (reference != nodes) return 1;
+    }
+
+    return 0;
+}
+
+// Probability that the next hand is unplayable on a given board.
+int run_danger_command(int argc, char* argv[]){
+    const piece_catalog& catalog = get_piece_catalog();
+
+    uint64_t board = 0;
+    unsigned threads = 0;
+    try {
+        for (int i = 0; i < argc; i++){
+            string arg = argv[i];
+            bool has_value = i + 1 < argc;
+            if (arg == "--board" && has_value) board = stoull(argv[++i], nullptr, 16);
+            else if (arg == "--threads" && has_value) threads = stoul(argv[++i]);
+            else throw runtime_error("unknown option " + arg);
+        }
+    } catch (const std::exception& e) {
+        cerr << e.what() << endl;
+        cerr << "usage: danger --board HEX [--threads T]" << endl;
+        return 1;
+    }
+
+    thread_pool pool(threads);
+    danger_analyzer danger(catalog.masks, pool);
+    danger.set_weights(catalog.probabilities);
+
+    auto start = chrono::steady_clock::now();
+    danger_report report = danger.analyze(board);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "no piece fits: " << report.no_move * 100 << "%" << endl;
+    cout << "hand can't be completed: " << report.dies_in_hand * 100 << "%" << endl;
+    cout << "analyzed in " << seconds * 1000 << " ms on " << pool.size() << " threads" << endl;
+
+    return 0;
+}
+
+// Lets the Monte Carlo player, or with --greedy the greedy player, play whole
+// games. --weights loads the best weights of a tuner checkpoint into the
+// player's board evaluation, and --risk sets the greedy player's weight for
+// the chance of dying in the next hand. With --record the games are added to
+// the stats and the game history like games played by hand.
+int run_bot_command(int argc, char* argv[]){
+    const piece_catalog& catalog = get_piece_catalog();
+
+    size_t games = 1;
+    unsigned threads = 0;
+    uint64_t seed = game_rng::make_seed();
+    bool record = false;
+    bool quiet = false;
+    unsigned rollouts = 64;
+    unsigned horizon = 2;
+    bool greedy = false;
+    string weights_file;
+    string risk_weight;
+    bool valid = true;
+
+    for (int i = 0; i < argc && valid; i++){
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--games" && has_value) valid = parse_option(arg, argv[++i], games, 1);
+        else if (arg == "--rollouts" && has_value) valid = parse_option(arg, argv[++i], rollouts);
+        else if (arg == "--horizon" && has_value) valid = parse_option(arg, argv[++i], horizon);
+        else if (arg == "--threads" && has_value) valid = parse_option(arg, argv[++i], threads, 1, MAX_THREADS);
+        else if (arg == "--seed" && has_value) valid = parse_option(arg, argv[++i], seed);
+        else if (arg == "--record") record = true;
+        else if (arg == "--quiet") quiet = true;
+        else if (arg == "--greedy") greedy = true;
+        else if (arg == "--weights" && has_value) weights_file = argv[++i];
+        else if (arg == "--risk" && has_value) risk_weight = argv[++i];
+        else{
+            cerr << "usage: bot [--games N] [--rollouts K] [--horizon H] [--threads T] [--seed S] [--greedy] [--weights FILE] [--risk W] [--record] [--quiet]" << endl;
+            return 1;
+        }
+    }
+    if (!valid) return 1;
+
+    thread_pool pool(threads);
+    monte_carlo_player player(catalog, pool);
+    player.rollouts = rollouts;
+    player.horizon = horizon;
+    greedy_player greedy_bot(catalog);
+
+    if (!weights_file.empty()){
+        try {
+            if (!load_tuned_weights(weights_file, greedy_bot.evaluator)){
+                cerr << "Error: Can't open tuner checkpoint " << weights_file << endl;
+                return 1;
+            }
+        } catch (const std::exception& e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        player.evaluator = &greedy_bot.evaluator.linear;
+    }
+    if (!risk_weight.empty()){
+        if (!greedy){
+            cerr << "Error: --risk needs --greedy" << endl;
+            return 1;
+        }
+        size_t used = 0;
+        try {
+            greedy_bot.evaluator.risk_weight = stof(risk_weight, &used);
+        } catch (const std::exception&) {
+            used = 0;
+        }
+        if (used != risk_weight.size() || !isfinite(greedy_bot.evaluator.risk_weight)){
+            cerr << "Error: --risk must be a number" << endl;
+            return 1;
+        }
+    }
+
+    // Only the greedy player has a risk term; it analyzes on the whole pool.
+    unique_ptr<danger_analyzer> danger;
+    if (greedy && greedy_bot.evaluator.risk_weight != 0){
+        danger = make_unique<danger_analyzer>(catalog.masks, pool);
+        danger->set_weights(catalog.probabilities);
+        greedy_bot.danger = danger.get();
+    }
+
+    uint64_t total_score = 0;
+    size_t total_moves = 0;
+    auto start = chrono::steady_clock::now();
+
+    for (size_t g = 0; g < games; g++){
+        uint64_t game_seed = seed + g;
+        game_rng rng(game_seed);
+        engine_state state;
+        game_hand hand;
+        hand.draw(rng, catalog);
+
+        game_record record_entry;
+        record_entry.seed = game_seed;
+        auto game_start = chrono::steady_clock::now();
+
+        // Both players take a word from the generator per move, so a seed
+        // deals the same hands whichever one plays.
+        placement move;
+        while (true){
+            uint64_t move_seed = rng.next();
+            if (greedy ? !greedy_bot.choose(state, hand, move) : !player.choose(state, hand, move_seed, move)) break;
+
+            cleared_lines cleared;
+            state.play(catalog.masks[hand.pieces[move.slot]], move.row, move.col, &cleared);
+            hand.remove(move.slot);
+            if (hand.count == 0) hand.draw(rng, catalog);
+
+            record_entry.moves++;
+            record_entry.lines_cleared += cleared.rows + cleared.cols;
+            if (state.combo > record_entry.max_combo) record_entry.max_combo = state.combo;
+        }
+
+        record_entry.score = state.score;
+        record_entry.duration_ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - game_start).count();
+        total_score += state.score;
+        total_moves += record_entry.moves;
+
+        if (record){
+            record_game_stats(record_entry.score, record_entry.moves);
+            get_history_writer().append(record_entry);
+        }
+        if (!quiet){
+            cout << "Game " << g + 1 << " (seed " << game_seed << "): score " << state.score << ", " << record_entry.moves << " moves" << endl;
+        }
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << games << " games, mean score " << (double)total_score / games << ", " << total_moves << " moves" << endl;
+    if (greedy){
+        cout << "played in " << seconds << " s" << endl;
+        return 0;
+    }
+    cout << player.rollouts_played << " rollouts on " << pool.size() << " threads in " << seconds << " s";
+    if (seconds > 0) cout << " (" << (size_t)(player.rollouts_played / seconds) << " rollouts/s)";
+    cout << endl;
+
+    return 0;
+}
+
+// Tunes the linear evaluator's weights with a genetic algorithm, scoring
+// every candidate by greedy self-play. --risk evolves the weight of the
+// danger term as well. Resumes from the checkpoint if there is one, and
+// writes it again after every generation.
+int run_tune_command(int argc, char* argv[]){
+    const piece_catalog& catalog = get_piece_catalog();
+
+    unsigned generations = 20;
+    unsigned population = 32;
+    unsigned threads = 0;
+    uint64_t seed = game_rng::make_seed();
+    string checkpoint = TUNER_CHECKPOINT_FILE;
+    unsigned games = 64;
+    size_t max_moves = 2000;
+    bool risk = false;
+    bool valid = true;
+
+    // Population and games are capped so their product, the games of one
+    // generation, stays a sane allocation.
+    for (int i = 0; i < argc && valid; i++){
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--generations" && has_value) valid = parse_option(arg, argv[++i], generations);
+        else if (arg == "--population" && has_value) valid = parse_option(arg, argv[++i], population, 2, 65536);
+        else if (arg == "--games" && has_value) valid = parse_option(arg, argv[++i], games, 1, 65536);
+        else if (arg == "--max-moves" && has_value) valid = parse_option(arg, argv[++i], max_moves, 1);
+        else if (arg == "--threads" && has_value) valid = parse_option(arg, argv[++i], threads, 1, MAX_THREADS);
+        else if (arg == "--seed" && has_value) valid = parse_option(arg, argv[++i], seed);
+        else if (arg == "--checkpoint" && has_value) checkpoint = argv[++i];
+        else if (arg == "--risk") risk = true;
+        else{
+            cerr << "usage: tune [--generations N] [--population P] [--games G] [--max-moves M] [--threads T] [--seed S] [--checkpoint FILE] [--risk]" << endl;
+            return 1;
+        }
+    }
+    if (!valid) return 1;
+
+    thread_pool pool(threads);
+    weight_tuner tuner(catalog, pool, seed);
+    tuner.games = games;
+    tuner.max_moves = max_moves;
+    tuner.risk = risk;
+
+    try {
+        if (tuner.load(checkpoint)) cout << "Resuming " << checkpoint << " at generation " << tuner.generation << endl;
+        else tuner.initialize(linear_evaluator(), population);
+    } catch (const std::exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    for (unsigned g = 0; g < generations; g++){
+        auto start = chrono::steady_clock::now();
+        tuner.evaluate();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        double mean = 0;
+        for (const tuner_candidate& c : tuner.population) mean += c.fitness;
+        mean /= tuner.population.size();
+
+        cout << "Generation " << tuner.generation << ": best " << fixed << setprecision(1) << tuner.population[0].fitness
+             << ", mean " << mean << defaultfloat << " (" << tuner.population.size() * tuner.games << " games in " << seconds << " s)" << endl;
+
+        tuner.breed();
+        if (!tuner.save(checkpoint)) std::cerr << "failed to write " << checkpoint << ".\n";
+    }
+
+    cout << "Best weights:" << setprecision(6);
+    for (unsigned i = 0; i < FEATURE_COUNT; i++) cout << " " << tuner.population[0].weights[i];
+    if (tuner.risk) cout << ", risk " << tuner.population[0].risk_weight;
+    cout << endl;
+
+    return 0;
+}
+
+// Plays the machine protocol (libraries/Protocol.cpp) over stdin and stdout,
+// for bots that drive the game as a child process.
+int run_machine_command(){
+    const piece_catalog& catalog = get_piece_catalog();
+
+    protocol_session session;
+    string output;
+    char buffer[1 << 16];
+
+    while (true){
+        ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+
+        bool keep = n > 0 && session.feed(catalog, buffer, n, output);
+
+        size_t written = 0;
+        while (written < output.size()){
+            ssize_t w = write(STDOUT_FILENO, output.data() + written, output.size() - written);
+            if (w < 0){
+                if (errno == EINTR) continue;
+                return 1;
+            }
+            written += w;
+        }
+        output.clear();
+
+        if (!keep) break;
+    }
+
+    return 0;
+}
+
+// Serves games to many clients from one process, on a localhost TCP port or
+// a Unix socket.
+int run_server_command(int argc, char* argv[]){
+    const piece_catalog& catalog = get_piece_catalog();
+
+    uint16_t port = 7777;
+    string unix_path;
+    unsigned threads = thread::hardware_concurrency();
+    bool valid = true;
+
+    for (int i = 0; i < argc && valid; i++){
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--port" && has_value) valid = parse_option(arg, argv[++i], port, 1);
+        else if (arg == "--unix" && has_value) unix_path = argv[++i];
+        else if (arg == "--threads" && has_value) valid = parse_option(arg, argv[++i], threads, 1, MAX_THREADS);
+        else{
+            cerr << "usage: server [--port N | --unix PATH] [--threads T]" << endl;
+            return 1;
+        }
+    }
+    if (!valid) return 1;
+
+    game_server server(catalog);
+    try {
+        if (unix_path.empty()) server.listen_tcp(port);
+        else server.listen_unix(unix_path);
+    } catch (const std::exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    cout << "Serving on " << (unix_path.empty() ? "127.0.0.1:" + to_string(port) : unix_path) << endl;
+    try {
+        server.run(threads);
+    } catch (const std::exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char* argv[]){
+    if (getenv("BLOCKS_PROFILE") || (argc > 1 && string(argv[1]) == "--profile")){
+        game_profiler::enable();
+        if (argc > 1 && string(argv[1]) == "--profile"){
+            argc--;
+            argv++;
+        }
+    }
+    if (argc > 2 && string(argv[1]) == "--shapes"){
+        shape_file_path = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
+
+    try {
+        get_piece_catalog();
+    } catch (const std::exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    if (argc > 1 && string(argv[1]) == "replay"){
+        return run_replay_command(argc - 2, argv + 2);
+    }
+    if (argc > 1 && string(argv[1]) == "danger"){
+        return run_danger_command(argc - 2, argv + 2);
+    }
+    if (argc > 1 && string(argv[1]) == "perft"){
+        return run_perft_command(argc - 2, argv + 2);
+    }
+    if (argc > 1 && string(argv[1]) == "machine"){
+        return run_machine_command();
+    }
+    if (argc > 1 && string(argv[1]) == "tune"){
+        return run_tune_command(argc - 2, argv + 2);
+    }
+    if (argc > 1 && string(argv[1]) == "server"){
+        return run_server_command(argc - 2, argv + 2);
+    }
+    // Not in the README: checks the Matrix library, for development.
+    if (argc > 1 && string(argv[1]) == "matrix-selftest"){
+        try {
+            return matrix_self_test(cout).run() == 0 ? 0 : 1;
+        } catch (const std::exception& e) {
+            cerr << e.what() << endl;
+            return 1;
+        }
+    }
+    // Buffered stats and history are flushed here rather than from atexit,
+    // while the stores they live in still exist.
+    if (argc > 1 && string(argv[1]) == "bot"){
+        int status = run_bot_command(argc - 2, argv + 2);
+        flush_game_data();
+        return status;
+    }
+
     run_application();
+    flush_game_data();
     
     return 0;
 }
\ No newline at end of file